@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // O_DIRECT
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
@@ -6,6 +7,15 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <time.h>
+#ifdef __linux__
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 
 #define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
 #define INVALID_PAGE_NUM UINT32_MAX
@@ -25,19 +35,210 @@ const uint32_t USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
 const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
 const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE; // 293
 
-const uint32_t TABLE_MAX_PAGES = 100;
-const uint32_t PAGE_SIZE = 4096;
+#define TABLE_MAX_PAGES 100
+// Chosen when the file is created and kept in its header, a power of two in this range
+const uint32_t DEFAULT_PAGE_SIZE = 4096;
+const uint32_t MIN_PAGE_SIZE = 4096;
+const uint32_t MAX_PAGE_SIZE = 65536;
+
+// Page trailer, a CRC32C of the rest of the page written on flush and verified on load
+const uint32_t PAGE_CHECKSUM_SIZE = sizeof(uint32_t);
+
+// Database header, the first block of the file, pages start right after it.
+// Compressed files keep a page map here and store variable size pages after it
+const char DB_MAGIC[4] = {'S', 'Q', 'L', 'D'};
+const uint32_t DB_MAGIC_SIZE = sizeof(DB_MAGIC);
+const uint32_t DB_FLAGS_OFFSET = DB_MAGIC_SIZE;
+const uint32_t DB_NUM_PAGES_OFFSET = DB_FLAGS_OFFSET + sizeof(uint32_t);
+const uint32_t DB_PAGE_SIZE_OFFSET = DB_NUM_PAGES_OFFSET + sizeof(uint32_t);
+const uint32_t DB_PAGE_MAP_OFFSET = DB_PAGE_SIZE_OFFSET + sizeof(uint32_t);
+const uint32_t DB_HEADER_SIZE = 4096; // one page, so the pages after it stay aligned
+const uint32_t DB_HEADER_CHECKSUM_OFFSET = DB_HEADER_SIZE - sizeof(uint32_t);
+const uint32_t COMPRESSED_SLOT_ALIGNMENT = 64;
+
+// Database header mem format
+//  byte 0-3   byte 4-7   byte 8-11   byte 12-15   byte 16-1215                 byte 1216-1219   byte 1220-1223        byte 4092-4095
+//  DB_MAGIC   FLAGS      NUM_PAGES   PAGE_SIZE    PAGE_MAP (compressed only)   VERSION          INTERNAL_MAX_CELLS    HEADER_CHECKSUM
+
+// Rollback journal, "<db>-journal", holds the pre-images of the pages a commit
+// is about to overwrite. The header is written after the entries, so a journal
+// without a valid header never got as far as touching the database
+const char JOURNAL_MAGIC[4] = {'S', 'Q', 'L', 'J'};
+const uint32_t JOURNAL_PAGE_SIZE_OFFSET = sizeof(JOURNAL_MAGIC);
+const uint32_t JOURNAL_NUM_PAGES_OFFSET = JOURNAL_PAGE_SIZE_OFFSET + sizeof(uint32_t);
+const uint32_t JOURNAL_NUM_ENTRIES_OFFSET = JOURNAL_NUM_PAGES_OFFSET + sizeof(uint32_t);
+const uint32_t JOURNAL_CHECKSUM_OFFSET = JOURNAL_NUM_ENTRIES_OFFSET + sizeof(uint32_t);
+const uint32_t JOURNAL_HEADER_SIZE = JOURNAL_CHECKSUM_OFFSET + sizeof(uint32_t);
+
+// Journal mem format
+//  byte 0-3       byte 4-7    byte 8-11   byte 12-15    byte 16-19        entries
+//  JOURNAL_MAGIC  PAGE_SIZE   NUM_PAGES   NUM_ENTRIES   HEADER_CHECKSUM   (page_num, page image)...
+
+typedef enum {
+	DB_FLAG_COMPRESSED = 1 << 0,
+	DB_FLAG_SUBTREE_COUNTS = 1 << 1
+} DbFlags;
+
+typedef struct {
+	uint32_t offset; // 0 means the page was never written
+	uint32_t length; // == page size means the page is stored uncompressed
+	uint32_t capacity;
+} PageMapEntry;
+
+// Layout of the header and the pages, bumped whenever either changes. Files from
+// before the header are migrated on open, other versions are refused
+const uint32_t DB_FORMAT_VERSION = 1;
+const uint32_t DB_VERSION_OFFSET = DB_PAGE_MAP_OFFSET + TABLE_MAX_PAGES * sizeof(PageMapEntry);
+const uint32_t DB_INTERNAL_MAX_CELLS_OFFSET = DB_VERSION_OFFSET + sizeof(uint32_t);
+
+// a run of compressed file bytes no page map entry points to
+typedef struct {
+	uint32_t offset;
+	uint32_t capacity;
+} FreeSlot;
+
+/*
+ * Bump allocator for per-statement scratch like cursors, everything it hands
+ * out is released at once when the statement is done
+*/
+#define ARENA_CHUNK_SIZE (64 * 1024)
+const size_t ARENA_ALIGNMENT = 16;
+
+typedef struct ArenaChunk {
+	struct ArenaChunk* next;
+	size_t used;
+	size_t capacity;
+	uint8_t data[];
+} ArenaChunk;
+
+typedef struct {
+	ArenaChunk* chunks; // newest first
+} Arena;
+
+/*
+ * Page frames carved from one page aligned block, so they can be handed to
+ * O_DIRECT reads and writes. Besides the cache, frames serve as read scratch
+ * for the checker threads and the compression buffer
+*/
+#define FRAME_POOL_SCRATCH_FRAMES 32
+const size_t FRAME_ALIGNMENT = 4096;
+
+typedef struct {
+	uint8_t* memory;
+	uint32_t frame_size;
+	uint32_t num_frames;
+	uint32_t num_used; // frames below this were handed out at least once
+	uint32_t* free_frames;
+	uint32_t num_free;
+	pthread_mutex_t lock;
+} FramePool;
+
+/*
+ * When the file is forced to stable storage.
+ * NORMAL syncs once on close, FULL also syncs the pages before the header
+ * is written, so the header never describes pages that are not on disk yet
+*/
+typedef enum {
+	SYNC_OFF,
+	SYNC_NORMAL,
+	SYNC_FULL
+} SyncPolicy;
+
+typedef struct {
+	// only used when creating a file, existing files keep these in their header
+	bool compress;
+	bool subtree_counts;
+	uint32_t page_size;
+	uint32_t internal_node_max_cells; // 0 fills the page
+	// apply to this open only
+	bool direct_io;
+	SyncPolicy sync;
+	uint32_t writeback_ratio;
+	uint32_t writeback_rate;
+	bool bloom;
+} OpenOptions;
 
 typedef struct {
 	int file_descriptor;
 	uint32_t file_length;
 	uint32_t num_pages;
+	// node layout, derived from the page size of the file
+	uint32_t page_size;
+	uint32_t leaf_node_max_cells;
+	uint32_t leaf_node_left_split_count;
+	uint32_t leaf_node_right_split_count;
+	uint32_t internal_node_max_cells; // kept in the header, fewer than fit when the file asked for it
 	void* pages[TABLE_MAX_PAGES];
+	bool compressed;
+	bool subtree_counts; // internal nodes keep the row count of each child
+	bool direct_io; // bypasses the kernel page cache, the frames are the only cache
+	SyncPolicy sync;
+	PageMapEntry page_map[TABLE_MAX_PAGES];
+	FreeSlot free_slots[TABLE_MAX_PAGES]; // gaps between the slots of the map the file was opened with
+	uint32_t num_free_slots;
+	void* compress_buffer;
+	FramePool frames;
+	pthread_mutex_t lock; // guards cache misses, pages may be loaded from worker threads
+	uint8_t dirty[TABLE_MAX_PAGES];
+	// open transaction, pre-images of the pages it changed and the page count it started with
+	bool in_transaction;
+	void* journal[TABLE_MAX_PAGES];
+	uint32_t journal_num_pages;
+	char* journal_path;
+	// request being served, its changes are undone if a page error stops it, see pager_undo_request
+	bool in_request;
+	void* undo[TABLE_MAX_PAGES]; // pre-images, kept between requests
+	bool undo_saved[TABLE_MAX_PAGES];
+	uint8_t undo_dirty[TABLE_MAX_PAGES];
+	uint32_t undo_num_pages;
+	// background writeback, see writeback_thread
+	uint32_t writeback_ratio; // percent of cached pages allowed to be dirty, 100 turns it off
+	uint32_t writeback_rate; // pages per second
+	bool writeback_running;
+	bool writeback_stop;
+	pthread_t writeback_thread;
+	pthread_cond_t writeback_wake;
+	pthread_mutex_t write_lock; // held while pages change and while writeback copies them out
+	pthread_mutex_t io_lock; // keeps a stale writeback copy from landing after a newer flush
+	uint64_t pages_written_back;
 } Pager;
 
+typedef enum {
+	PAGE_READ_SUCCESS,
+	PAGE_READ_NEW, // not written to the file yet
+	PAGE_READ_BAD_CHECKSUM,
+	PAGE_READ_CORRUPT
+} PageReadResult;
+
+/*
+ * The leaf the last lookup landed on and the key range that routes to it.
+ * Splits are the only thing that move the routing, so they clear it
+*/
+typedef struct {
+	bool valid;
+	uint32_t page_num;
+	int64_t lower_bound; // exclusive
+	int64_t upper_bound; // inclusive
+} LeafHint;
+
+/*
+ * Keys of the table, rebuilt from the leaves at open. Nothing is ever deleted,
+ * keys of a rolled back insert just stay behind as false positives
+*/
+typedef struct {
+	uint8_t* bits; // NULL when the filter is off
+	uint32_t num_bits;
+	uint64_t negatives; // lookups answered without touching the tree
+} BloomFilter;
+
 typedef struct {
 	uint32_t root_page_num;
 	Pager* pager;
+	Arena scratch; // cursors and temporaries of the running statement
+	LeafHint last_leaf;
+	uint64_t lookups;
+	uint64_t hint_hits;
+	BloomFilter bloom;
 } Table;
 
 typedef struct {
@@ -62,17 +263,49 @@ typedef enum {
 
 typedef enum {
 	STATEMENT_INSERT,
-	STATEMENT_SELECT
+	STATEMENT_SELECT,
+	STATEMENT_AGGREGATE,
+	STATEMENT_BEGIN,
+	STATEMENT_COMMIT,
+	STATEMENT_ROLLBACK
 } StatementType;
 
+#define MAX_AGGREGATES 4
+typedef enum {
+	AGGREGATE_COUNT,
+	AGGREGATE_MIN,
+	AGGREGATE_MAX,
+	AGGREGATE_SUM
+} AggregateType;
+
+typedef enum {
+	COMPARE_LESS,
+	COMPARE_LESS_EQUAL,
+	COMPARE_GREATER,
+	COMPARE_GREATER_EQUAL,
+	COMPARE_EQUAL
+} CompareOperator;
+
 typedef enum {
 	EXECUTE_SUCCESS,
-	EXECUTE_DUPLICATED_KEY
+	EXECUTE_DUPLICATED_KEY,
+	EXECUTE_NO_TRANSACTION,
+	EXECUTE_TRANSACTION_ACTIVE,
+	EXECUTE_TRANSACTION_UNSUPPORTED,
+	EXECUTE_TABLE_FULL
 } ExecuteResult;
 
 typedef struct {
 	StatementType type;
 	Row row_to_insert;
+	bool ordered; // select rows in key order, "select unordered" lets parallel ranges interleave
+	uint64_t limit; // UINT64_MAX when there is no limit
+	uint64_t offset;
+	AggregateType aggregates[MAX_AGGREGATES];
+	uint32_t num_aggregates;
+	bool has_where; // count(*) where id <op> where_key
+	CompareOperator where_operator;
+	uint32_t where_key;
 } Statement;
 
 typedef enum {
@@ -103,10 +336,11 @@ const uint32_t LEAF_NODE_KEY_OFFSET = 0;
 const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE; // 293
 const uint32_t LEAF_NODE_VALUE_OFFSET = LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
 const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
-const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_MAX_CELLS = LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
-const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2; // 7
-const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT; // 7
+
+// The cell count depends on the page size, see pager_set_page_size. 13 cells with 4K pages
+uint32_t leaf_node_space_for_cells(uint32_t page_size) {
+	return page_size - LEAF_NODE_HEADER_SIZE - PAGE_CHECKSUM_SIZE;
+}
 
 // Leaf node header mem format
 //     byte 0      byte 1 - bool      byte 2-5             byte 6-9 					byte 10-13
@@ -116,6 +350,10 @@ const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) - LEAF_NOD
 //    byte 10-13               byte 14-306            byte 307-310           byte 311-603
 // LEAF_NODE_KEY(key 1)  LEAF_NODE_VALUE(byte 1)  LEAF_NODE_KEY(key 2)  LEAF_NODE_VALUE(value 2)
 
+// Page trailer mem format, same for every node type
+//   byte 4092-4095
+// PAGE_CHECKSUM
+
 // leaf methods
 Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key);
 void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value);
@@ -168,26 +406,33 @@ const uint32_t INTERNAL_NODE_NUM_KEYS_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_NUM_KEYS_OFFSET = COMMON_NODE_HEADER_SIZE;
 const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET = INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;
-const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE;
+const uint32_t INTERNAL_NODE_RIGHT_CHILD_COUNT_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_RIGHT_CHILD_COUNT_OFFSET = INTERNAL_NODE_RIGHT_CHILD_OFFSET + INTERNAL_NODE_RIGHT_CHILD_SIZE;
+const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE + INTERNAL_NODE_RIGHT_CHILD_COUNT_SIZE;
 
 // Internal node body format
 const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
-const uint32_t INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
-const uint32_t INTERNAL_NODE_MAX_CELLS = 3;
+const uint32_t INTERNAL_NODE_COUNT_SIZE = sizeof(uint32_t); // rows under the child, with subtree counts
+const uint32_t INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE + INTERNAL_NODE_COUNT_SIZE;
+const uint32_t INTERNAL_NODE_MIN_CELLS = 3; // a split keeps a key on each side of the middle one
+
+// The cell count depends on the page size, see pager_set_page_size. 339 cells with 4K pages
+uint32_t internal_node_cells_for_page(uint32_t page_size) {
+	return (page_size - INTERNAL_NODE_HEADER_SIZE - PAGE_CHECKSUM_SIZE) / INTERNAL_NODE_CELL_SIZE;
+}
 
 // Internal node body format
 // Internal node header mem format
-//     byte 0      byte 1 - bool      byte 2-5                 byte 6-9                      byte 10-13
-// NODE_TYPE_SIZE  IS_ROOT_SIZE  PARENT_POINTER_SIZE  INTERNAL_NODE_NUM_KEYS_SIZE  INTERNAL_NODE_RIGHT_CHILD_SIZE
+//     byte 0      byte 1 - bool      byte 2-5                 byte 6-9                      byte 10-13                       byte 14-17
+// NODE_TYPE_SIZE  IS_ROOT_SIZE  PARENT_POINTER_SIZE  INTERNAL_NODE_NUM_KEYS_SIZE  INTERNAL_NODE_RIGHT_CHILD_SIZE  INTERNAL_NODE_RIGHT_CHILD_COUNT_SIZE
 
 // Internal node body mem format
-//       byte 14-17               byte 18-21                 byte 22-25             byte 26-29
-// INTERNAL_NODE_CHILD_SIZE  INTERNAL_NODE_KEY_SIZE  INTERNAL_NODE_CHILD_SIZE INTERNAL_NODE_KEY_SIZE  
-//       INTERNAL_NODE_CELL_SIZE (1)                        INTERNAL_NODE_CELL_SIZE (2)
+//       byte 18-21               byte 22-25                 byte 26-29                byte 30-33             byte 34-37             byte 38-41
+// INTERNAL_NODE_CHILD_SIZE  INTERNAL_NODE_KEY_SIZE  INTERNAL_NODE_COUNT_SIZE  INTERNAL_NODE_CHILD_SIZE INTERNAL_NODE_KEY_SIZE  INTERNAL_NODE_COUNT_SIZE
+//                    INTERNAL_NODE_CELL_SIZE (1)                                            INTERNAL_NODE_CELL_SIZE (2)
 
 // internal node methods
-Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key);
 uint32_t internal_node_find_child(void* node, uint32_t key);
 void internal_node_split_and_insert(Table *table, uint32_t parent_page_num, uint32_t child_page_num);
 void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num);
@@ -230,6 +475,39 @@ uint32_t* internal_node_key(void* node, uint32_t key_num) {
 	return (void*)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
 }
 
+uint32_t* internal_node_cell_count(void* node, uint32_t cell_num) {
+	return (void*)internal_node_cell(node, cell_num) + INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
+}
+
+uint32_t* internal_node_right_child_count(void* node) {
+	return node + INTERNAL_NODE_RIGHT_CHILD_COUNT_OFFSET;
+}
+
+/*
+ * Rows in the subtree under child_num, kept up to date only when the pager has subtree_counts
+*/
+uint32_t* internal_node_child_count(void* node, uint32_t child_num) {
+	if (child_num == *internal_node_num_keys(node)) {
+		return internal_node_right_child_count(node);
+	}
+	return internal_node_cell_count(node, child_num);
+}
+
+uint32_t node_row_count(void* node) {
+	if (get_node_type(node) == NODE_LEAF) {
+		return *leaf_node_num_cells(node);
+	}
+	if (*internal_node_right_child(node) == INVALID_PAGE_NUM) {
+		return 0;
+	}
+
+	uint32_t count = *internal_node_right_child_count(node);
+	for (uint32_t i = 0; i < *internal_node_num_keys(node); i++) {
+		count += *internal_node_cell_count(node, i);
+	}
+	return count;
+}
+
 uint32_t* node_parent(void* node) {
 	return node + PARENT_POINTER_OFFSET;
 }
@@ -240,6 +518,7 @@ void initialize_internal_node(void* node) {
 	*internal_node_num_keys(node) = 0;
 	// rightmost child initialize with invalid page number represents a empty node
 	*internal_node_right_child(node) = INVALID_PAGE_NUM;
+	*internal_node_right_child_count(node) = 0;
 }
 
 bool is_node_root(void* node) {
@@ -247,13 +526,14 @@ bool is_node_root(void* node) {
 	return (bool)isRoot;
 }
 
-void print_constants() {
+void print_constants(Pager* pager) {
 	printf("ROW_SIZE: %d\n", ROW_SIZE);
 	printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
 	printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
 	printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-	printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-	printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+	printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", leaf_node_space_for_cells(pager->page_size));
+	printf("LEAF_NODE_MAX_CELLS: %d\n", pager->leaf_node_max_cells);
+	printf("INTERNAL_NODE_MAX_CELLS: %d\n", pager->internal_node_max_cells);
 }
 
 typedef struct {
@@ -282,260 +562,1353 @@ void serialize_row(Row *r, void* dest) {
 	strncpy(dest + EMAIL_OFFSET, r->email, EMAIL_SIZE);
 }
 
-void deserialize_row(void *source, Row *r) {
-	memcpy(&(r->id), source + ID_OFFSET, ID_SIZE);
-	memcpy(&(r->username), source + USERNAME_OFFSET, USERNAME_SIZE);
-	memcpy(&(r->email), source + EMAIL_OFFSET, EMAIL_SIZE);
-}
-
-Pager* pager_open(const char* filename) {
-	int fd = open(filename,
-		     O_RDWR | O_CREAT,
-		     S_IWUSR | S_IRUSR
-		);
-	
-	if (fd == -1) {
-		printf("unable to open file\n");
-		exit(EXIT_FAILURE);
+void* arena_alloc(Arena* arena, size_t size) {
+	size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+
+	ArenaChunk* chunk = arena->chunks;
+	if (chunk == NULL || chunk->used + size > chunk->capacity) {
+		size_t capacity = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+		chunk = malloc(sizeof(ArenaChunk) + capacity);
+		chunk->next = arena->chunks;
+		chunk->used = 0;
+		chunk->capacity = capacity;
+		arena->chunks = chunk;
 	}
 
-	off_t file_length = lseek(fd, 0, SEEK_END);
-
-	Pager* pager = malloc(sizeof(Pager));
-	pager->file_descriptor = fd;
-	pager->file_length = file_length;
-	pager->num_pages = file_length / PAGE_SIZE;
+	void* ptr = chunk->data + chunk->used;
+	chunk->used += size;
+	return ptr;
+}
 
-	if (file_length % PAGE_SIZE != 0) {
-		printf("db file is not a whole number of pages. Corrupt file\n");
-		exit(EXIT_FAILURE);
+/*
+ * Keeps the oldest chunk, so a statement that fits in one chunk
+ * never reaches malloc after the first one
+*/
+void arena_reset(Arena* arena) {
+	ArenaChunk* chunk = arena->chunks;
+	if (chunk == NULL) {
+		return;
 	}
 
-	for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) { 
-		pager->pages[i] = NULL;
+	while (chunk->next != NULL) {
+		ArenaChunk* next = chunk->next;
+		free(chunk);
+		chunk = next;
 	}
+	chunk->used = 0;
+	arena->chunks = chunk;
+}
 
-	return pager;
+void arena_free(Arena* arena) {
+	arena_reset(arena);
+	free(arena->chunks);
+	arena->chunks = NULL;
 }
 
-void pager_flush(Pager* pager, uint32_t page_num) {
-	if (pager->pages[page_num] == NULL) {
-		printf("trying to flush null page\n");
+void frame_pool_init(FramePool* pool, uint32_t num_frames, uint32_t frame_size) {
+	if (posix_memalign((void**)&pool->memory, FRAME_ALIGNMENT, (size_t)num_frames * frame_size) != 0) {
+		printf("unable to allocate page frames\n");
 		exit(EXIT_FAILURE);
 	}
+	pool->frame_size = frame_size;
+	pool->num_frames = num_frames;
+	pool->num_used = 0;
+	pool->free_frames = malloc(sizeof(uint32_t) * num_frames);
+	pool->num_free = 0;
+	pthread_mutex_init(&pool->lock, NULL);
+}
 
-	off_t page_offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-	if (page_offset == -1) {
-		printf("error seeking %d\n", errno);
+void* frame_alloc(FramePool* pool) {
+	pthread_mutex_lock(&pool->lock);
+	uint32_t frame;
+	if (pool->num_free > 0) {
+		frame = pool->free_frames[--pool->num_free];
+	} else if (pool->num_used < pool->num_frames) {
+		// untouched frames are handed out in order, the block is only faulted in as it is used
+		frame = pool->num_used++;
+	} else {
+		printf("out of page frames\n");
 		exit(EXIT_FAILURE);
 	}
+	pthread_mutex_unlock(&pool->lock);
 
-  ssize_t res = write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
-	if (res == -1) {
-		printf("error: %d::when try to flush page %d", errno, page_num);
-		exit(EXIT_FAILURE);
-	}
+	return pool->memory + (size_t)frame * pool->frame_size;
 }
 
-void* get_page(Pager* pager, uint32_t page_num) {
-  if (page_num > TABLE_MAX_PAGES) {
-    printf("tried to fetch page number out of bounds. %d > %d\n", page_num, TABLE_MAX_PAGES);
-    exit(EXIT_FAILURE);
-  }
-
-  if  (pager->pages[page_num] == NULL) {
-		// cache miss
-    void* page = malloc(PAGE_SIZE);
-    uint32_t pages_qtd = pager->file_length / PAGE_SIZE;
-
-    if (pager->file_length % PAGE_SIZE) {
-			// save a partial page
-      pages_qtd += 1;
-    }
-
-    if (page_num <= pages_qtd) {
-      lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-      ssize_t pages_bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
-      if (pages_bytes_read == -1) {
-        printf("Error reading file: %d\n", errno);
-        exit(EXIT_FAILURE);
-      }
-    }
+void frame_free(FramePool* pool, void* ptr) {
+	if (ptr == NULL) {
+		return;
+	}
 
-    pager->pages[page_num] = page;
+	pthread_mutex_lock(&pool->lock);
+	pool->free_frames[pool->num_free++] = ((uint8_t*)ptr - pool->memory) / pool->frame_size;
+	pthread_mutex_unlock(&pool->lock);
+}
 
-    if (page_num >= pager->num_pages) {
-      pager->num_pages = page_num + 1;
-    }
-  }
+void frame_pool_destroy(FramePool* pool) {
+	free(pool->memory);
+	free(pool->free_frames);
+	pthread_mutex_destroy(&pool->lock);
+}
 
-  return pager->pages[page_num];
+void deserialize_row(void *source, Row *r) {
+	memcpy(&(r->id), source + ID_OFFSET, ID_SIZE);
+	memcpy(&(r->username), source + USERNAME_OFFSET, USERNAME_SIZE);
+	memcpy(&(r->email), source + EMAIL_OFFSET, EMAIL_SIZE);
 }
 
-uint32_t get_unused_page_num(Pager* pager) {
-	return pager->num_pages;
-} 
+/*
+ * Page codec, a small LZ77 in the LZ4 block style.
+ * Sequence: token (literal length << 4 | match length - 4), literals, 2 byte offset.
+ * Lengths >= 15 continue in extra bytes of 255. The last sequence only has literals.
+ * Rows are mostly zero padding, so a 4K leaf usually shrinks to a few hundred bytes.
+*/
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET UINT16_MAX
+
+uint32_t lz_hash(const uint8_t* p) {
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
 
-uint32_t get_node_max_key(Pager* pager, void* node) {
-	if (get_node_type(node) == NODE_LEAF) {
-		return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+uint8_t* lz_write_length(uint8_t* op, uint8_t* op_end, uint32_t length) {
+	while (length >= 255) {
+		if (op >= op_end) return NULL;
+		*op++ = 255;
+		length -= 255;
 	}
-	void* right_child = get_page(pager, *internal_node_right_child(node));
-	return get_node_max_key(pager, right_child);
+	if (op >= op_end) return NULL;
+	*op++ = length;
+	return op;
 }
 
-void create_new_root(Table* table, uint32_t right_child_page_num) {
-	/*
-	 * handle splitting the root.
-	 * old root copied to new page, becomes left child.
-	 * Address of right child passed in.
-	 * Re-initialize root page to contain the new root node.
-	 * New root node points to new children.
-	*/
-	void* root = get_page(table->pager, table->root_page_num);
-	void* right_child = get_page(table->pager, right_child_page_num);
-	uint32_t left_child_page_num = get_unused_page_num(table->pager);
-	void* left_child = get_page(table->pager, left_child_page_num);
+uint8_t* lz_write_sequence(uint8_t* op, uint8_t* op_end, const uint8_t* literals, uint32_t literal_length, uint32_t offset, uint32_t match_length) {
+	uint32_t match_code = match_length ? match_length - LZ_MIN_MATCH : 0;
+	if (op >= op_end) return NULL;
+	uint8_t* token = op++;
+	*token = ((literal_length < 15 ? literal_length : 15) << 4) | (match_code < 15 ? match_code : 15);
+
+	if (literal_length >= 15 && (op = lz_write_length(op, op_end, literal_length - 15)) == NULL) return NULL;
+	if (op + literal_length > op_end) return NULL;
+	memcpy(op, literals, literal_length);
+	op += literal_length;
+
+	if (match_length == 0) return op;
+	if (op + 2 > op_end) return NULL;
+	*op++ = offset & 0xFF;
+	*op++ = offset >> 8;
+	if (match_code >= 15 && (op = lz_write_length(op, op_end, match_code - 15)) == NULL) return NULL;
+	return op;
+}
 
-	if (get_node_type(root) == NODE_INTERNAL) {
-		initialize_internal_node(right_child);
-		initialize_internal_node(left_child);
-	}
+/*
+ * Returns the compressed size, or 0 when the output would not fit in dest_capacity
+*/
+uint32_t page_compress(const uint8_t* src, uint32_t src_size, uint8_t* dest, uint32_t dest_capacity) {
+	uint32_t table[1 << LZ_HASH_BITS];
+	memset(table, 0xFF, sizeof(table));
+
+	uint8_t* op = dest;
+	uint8_t* op_end = dest + dest_capacity;
+	uint32_t anchor = 0;
+	uint32_t ip = 0;
+
+	while (ip + LZ_MIN_MATCH <= src_size) {
+		uint32_t h = lz_hash(src + ip);
+		uint32_t candidate = table[h];
+		table[h] = ip;
+
+		if (candidate < ip && ip - candidate <= LZ_MAX_OFFSET && memcmp(src + candidate, src + ip, LZ_MIN_MATCH) == 0) {
+			uint32_t match_length = LZ_MIN_MATCH;
+			while (ip + match_length < src_size && src[candidate + match_length] == src[ip + match_length]) {
+				match_length++;
+			}
 
-	/*
-	 * copy old root to left child
-	*/
-	memcpy(left_child, root, PAGE_SIZE);
-	set_node_root(left_child, false);
+			op = lz_write_sequence(op, op_end, src + anchor, ip - anchor, ip - candidate, match_length);
+			if (op == NULL) return 0;
 
-	if (get_node_type(left_child) == NODE_INTERNAL) {
-		void* child;
-		for (int i = 0; i < *internal_node_num_keys(left_child); i++) {
-			child = get_page(table->pager, *internal_node_child(left_child, i));
-			*node_parent(child) = left_child_page_num;
+			ip += match_length;
+			anchor = ip;
+		} else {
+			ip++;
 		}
-		child = get_page(table->pager, *internal_node_right_child(left_child));
-		*node_parent(child) = left_child_page_num;
 	}
 
-	/*
-	 * The root node now is a internal node
-	*/
-	initialize_internal_node(root);
-	set_node_root(root, true);
-	*internal_node_num_keys(root) = 1;
-	*internal_node_child(root, 0) = left_child_page_num;
-	uint32_t left_child_max_key = get_node_max_key(table->pager, left_child);
-	*internal_node_key(root, 0) = left_child_max_key;
-	*internal_node_right_child(root) = right_child_page_num;
-	*node_parent(left_child) = table->root_page_num;
-	*node_parent(right_child) = table->root_page_num;
+	op = lz_write_sequence(op, op_end, src + anchor, src_size - anchor, 0, 0);
+	if (op == NULL) return 0;
+
+	return op - dest;
 }
 
-uint32_t internal_node_find_child(void* node, uint32_t key) {
-	uint32_t num_keys = *internal_node_num_keys(node);
+bool lz_read_length(const uint8_t** ip, const uint8_t* ip_end, uint32_t* length) {
+	uint8_t byte;
+	do {
+		if (*ip >= ip_end) return false;
+		byte = *(*ip)++;
+		*length += byte;
+	} while (byte == 255);
+	return true;
+}
 
-  // binary search
-	uint32_t start = 0;
-	uint32_t end = num_keys;
-	
-	while(start != end) {
-		uint32_t middle = (start + end) / 2;
-		uint32_t middle_key = *internal_node_key(node, middle);
-		if (middle_key >= key) {
-			end = middle;
-		} else {
-			start = middle + 1;
+/*
+ * Returns false if the input is malformed or does not decode to exactly dest_size bytes
+*/
+bool page_decompress(const uint8_t* src, uint32_t src_size, uint8_t* dest, uint32_t dest_size) {
+	const uint8_t* ip = src;
+	const uint8_t* ip_end = src + src_size;
+	uint8_t* op = dest;
+	uint8_t* op_end = dest + dest_size;
+
+	while (ip < ip_end) {
+		uint8_t token = *ip++;
+
+		uint32_t literal_length = token >> 4;
+		if (literal_length == 15 && !lz_read_length(&ip, ip_end, &literal_length)) return false;
+		if (ip + literal_length > ip_end || op + literal_length > op_end) return false;
+		memcpy(op, ip, literal_length);
+		ip += literal_length;
+		op += literal_length;
+
+		if (ip == ip_end) break; // last sequence has no match
+
+		if (ip + 2 > ip_end) return false;
+		uint32_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		uint32_t match_length = token & 0x0F;
+		if (match_length == 15 && !lz_read_length(&ip, ip_end, &match_length)) return false;
+		match_length += LZ_MIN_MATCH;
+
+		if (offset == 0 || offset > op - dest || op + match_length > op_end) return false;
+		// byte by byte, matches may overlap the bytes they produce
+		const uint8_t* match = op - offset;
+		for (uint32_t i = 0; i < match_length; i++) {
+			*op++ = *match++;
 		}
 	}
 
-	return start;
-}
-
-void update_internal_node_key(void* node, uint32_t old_key, uint32_t new_key) {
-	uint32_t old_child_index = internal_node_find_child(node, old_key);
-	*internal_node_key(node, old_child_index) = new_key;
+	return op == op_end;
 }
 
-void internal_node_split_and_insert(Table *table, uint32_t parent_page_num, uint32_t child_page_num) {
-	// save the old parent node context
-	uint32_t old_page_num = parent_page_num;
-	void* old_node = get_page(table->pager, parent_page_num);
-	uint32_t old_max = get_node_max_key(table->pager, old_node);
+/*
+ * CRC32C (Castagnoli), with the SSE4.2 or ARMv8 crc instructions when the cpu has them
+*/
+uint32_t crc32c_table[256];
+uint32_t (*crc32c_update)(uint32_t crc, const uint8_t* data, size_t length);
 
-	void* child_node = get_page(table->pager, child_page_num);
-	uint32_t child_max = get_node_max_key(table->pager, child_node);
+uint32_t crc32c_update_sw(uint32_t crc, const uint8_t* data, size_t length) {
+	while (length--) {
+		crc = crc32c_table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+	}
+	return crc;
+}
 
-	uint32_t new_page_num = get_unused_page_num(table->pager);
+#if defined(__x86_64__)
+#include <nmmintrin.h>
 
-	uint32_t splitting_root = is_node_root(old_node);
-	void* parent;
-	void* new_node;
-	if (splitting_root) {
-		create_new_root(table, new_page_num);
-		parent = get_page(table->pager, table->root_page_num);
-		// we should update the old_node to point to the new root`s left child
-		old_page_num = *internal_node_child(parent, 0);
-		old_node = get_page(table->pager, old_page_num);
-	} else {
-		// if we are splitting a non root node, 
-		// we cannot insert our new node into the old node because it does not yet contain any keys
-		parent = get_page(table->pager, *node_parent(old_node));
-		new_node = get_page(table->pager, new_page_num);
-		initialize_internal_node(new_node);
+__attribute__((target("sse4.2")))
+uint32_t crc32c_update_hw(uint32_t crc, const uint8_t* data, size_t length) {
+	uint64_t crc64 = crc;
+	for (; length >= sizeof(uint64_t); length -= sizeof(uint64_t), data += sizeof(uint64_t)) {
+		uint64_t value;
+		memcpy(&value, data, sizeof(value));
+		crc64 = _mm_crc32_u64(crc64, value);
 	}
+	crc = crc64;
+	while (length--) {
+		crc = _mm_crc32_u8(crc, *data++);
+	}
+	return crc;
+}
 
-	uint32_t* old_num_keys = internal_node_num_keys(old_node);
-	uint32_t current_page_num = *internal_node_right_child(old_node);
-	void* current_node = get_page(table->pager, current_page_num);
+bool crc32c_hw_supported() {
+	return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+
+uint32_t crc32c_update_hw(uint32_t crc, const uint8_t* data, size_t length) {
+	for (; length >= sizeof(uint64_t); length -= sizeof(uint64_t), data += sizeof(uint64_t)) {
+		uint64_t value;
+		memcpy(&value, data, sizeof(value));
+		crc = __crc32cd(crc, value);
+	}
+	while (length--) {
+		crc = __crc32cb(crc, *data++);
+	}
+	return crc;
+}
 
-	// first put right child into new node and set right child of old node to invalid page number
-	internal_node_insert(table, new_page_num, current_page_num);
-	*node_parent(current_node) = new_page_num;
-	*internal_node_right_child(old_node) = INVALID_PAGE_NUM;
+bool crc32c_hw_supported() {
+	return true;
+}
+#else
+uint32_t crc32c_update_hw(uint32_t crc, const uint8_t* data, size_t length) {
+	return crc32c_update_sw(crc, data, length);
+}
 
-	// for each key until you get to the middle key, move the key and the child to the new node
-	for(int i = INTERNAL_NODE_MAX_CELLS - 1; i > INTERNAL_NODE_MAX_CELLS / 2; i--) {
-		current_page_num = *internal_node_child(old_node, i);
-		current_node = get_page(table->pager, current_page_num);
+bool crc32c_hw_supported() {
+	return false;
+}
+#endif
 
-		internal_node_insert(table, new_page_num, current_page_num);
-		*node_parent(current_node) = new_page_num;
+void crc32c_init() {
+	if (crc32c_update != NULL) {
+		return;
+	}
 
-		(*old_num_keys)--;
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int bit = 0; bit < 8; bit++) {
+			crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1)); // reflected Castagnoli polynomial
+		}
+		crc32c_table[i] = crc;
 	}
 
-	// set child before middle key, which is now the highest key, to be node`s right child
-	// and decrement number of keys
-	*internal_node_right_child(old_node) = *internal_node_child(old_node, *old_num_keys - 1);
-	(*old_num_keys)--;
+	crc32c_update = crc32c_hw_supported() ? crc32c_update_hw : crc32c_update_sw;
+}
 
-	uint32_t max_after_split = get_node_max_key(table->pager, old_node);
-	uint32_t destination_page_num = child_max < max_after_split ? current_page_num : new_page_num;
+uint32_t* page_checksum(Pager* pager, void* page) {
+	return page + pager->page_size - PAGE_CHECKSUM_SIZE;
+}
 
-	internal_node_insert(table, destination_page_num, child_page_num);
-	*node_parent(child_node) = destination_page_num;
+uint32_t compute_page_checksum(Pager* pager, void* page) {
+	return ~crc32c_update(~0u, page, pager->page_size - PAGE_CHECKSUM_SIZE);
+}
 
-	update_internal_node_key(parent, old_max, max_after_split);
-	if (!splitting_root) {
-		internal_node_insert(table, *node_parent(old_node), new_page_num);
-		*node_parent(new_node) = *node_parent(old_node);
-	}
+// the header is read and written through a frame, so it is aligned for direct io
+bool is_valid_page_size(uint32_t page_size) {
+	return page_size >= MIN_PAGE_SIZE && page_size <= MAX_PAGE_SIZE && (page_size & (page_size - 1)) == 0;
 }
 
-void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t new_page_num) {
-	// Add a new child/key pair to parent that corresponds to child
-	void* parent = get_page(table->pager, parent_page_num);
-	void* child = get_page(table->pager, new_page_num);
+void pager_set_page_size(Pager* pager, uint32_t page_size) {
+	pager->page_size = page_size;
+	pager->leaf_node_max_cells = leaf_node_space_for_cells(page_size) / LEAF_NODE_CELL_SIZE;
+	pager->leaf_node_right_split_count = (pager->leaf_node_max_cells + 1) / 2;
+	pager->leaf_node_left_split_count = (pager->leaf_node_max_cells + 1) - pager->leaf_node_right_split_count;
+	pager->internal_node_max_cells = internal_node_cells_for_page(page_size);
+}
 
-	// child max key to insert in the parent
-	uint32_t child_max_key = get_node_max_key(table->pager, child);
+/*
+ * Slots left behind by pages that moved become free once a header without
+ * them is on disk, so they are collected at open rather than when the page
+ * moves, a crash before the header is written still finds the old slots intact.
+ * The last slot may not be filled up to its capacity, new slots go after all of them
+*/
+void pager_find_free_slots(Pager* pager) {
+	PageMapEntry* used[TABLE_MAX_PAGES];
+	uint32_t num_used = 0;
+	for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
+		PageMapEntry* entry = &pager->page_map[i];
+		if (entry->offset == 0) {
+			continue;
+		}
+		// insertion sort by offset, there are at most TABLE_MAX_PAGES
+		uint32_t j = num_used++;
+		while (j > 0 && used[j - 1]->offset > entry->offset) {
+			used[j] = used[j - 1];
+			j--;
+		}
+		used[j] = entry;
+	}
+
+	pager->num_free_slots = 0;
+	pager->file_length = DB_HEADER_SIZE;
+	for (uint32_t i = 0; i < num_used; i++) {
+		if (used[i]->offset > pager->file_length) {
+			pager->free_slots[pager->num_free_slots++] = (FreeSlot){ pager->file_length, used[i]->offset - pager->file_length };
+		}
+		pager->file_length = used[i]->offset + used[i]->capacity;
+	}
+}
+
+// first fit among the free slots, otherwise a new slot at the end of the file
+uint32_t pager_allocate_slot(Pager* pager, uint32_t capacity) {
+	for (uint32_t i = 0; i < pager->num_free_slots; i++) {
+		FreeSlot* slot = &pager->free_slots[i];
+		if (slot->capacity >= capacity) {
+			uint32_t offset = slot->offset;
+			slot->offset += capacity;
+			slot->capacity -= capacity;
+			return offset;
+		}
+	}
+
+	uint32_t offset = pager->file_length;
+	pager->file_length += capacity;
+	return offset;
+}
+
+// read before the frames exist, which is also before direct io is turned on
+void pager_read_header(Pager* pager) {
+	uint8_t header[DB_HEADER_SIZE];
+	ssize_t bytes_read = pread(pager->file_descriptor, header, DB_HEADER_SIZE, 0);
+	if (bytes_read != DB_HEADER_SIZE || memcmp(header, DB_MAGIC, DB_MAGIC_SIZE) != 0) {
+		printf("not a database file\n");
+		exit(EXIT_FAILURE);
+	}
+
+	uint32_t checksum;
+	memcpy(&checksum, header + DB_HEADER_CHECKSUM_OFFSET, sizeof(uint32_t));
+	if (checksum != ~crc32c_update(~0u, header, DB_HEADER_CHECKSUM_OFFSET)) {
+		printf("db header checksum mismatch. Corrupt file\n");
+		exit(EXIT_FAILURE);
+	}
+
+	uint32_t version;
+	memcpy(&version, header + DB_VERSION_OFFSET, sizeof(uint32_t));
+	if (version != DB_FORMAT_VERSION) {
+		printf("unsupported format version %d, this build reads version %d\n", version, DB_FORMAT_VERSION);
+		exit(EXIT_FAILURE);
+	}
+
+	uint32_t flags;
+	memcpy(&flags, header + DB_FLAGS_OFFSET, sizeof(uint32_t));
+	pager->compressed = flags & DB_FLAG_COMPRESSED;
+	pager->subtree_counts = flags & DB_FLAG_SUBTREE_COUNTS;
+
+	uint32_t page_size;
+	memcpy(&page_size, header + DB_PAGE_SIZE_OFFSET, sizeof(uint32_t));
+	if (!is_valid_page_size(page_size)) {
+		printf("db header has page size %d. Corrupt file\n", page_size);
+		exit(EXIT_FAILURE);
+	}
+	pager_set_page_size(pager, page_size);
+
+	uint32_t internal_node_max_cells;
+	memcpy(&internal_node_max_cells, header + DB_INTERNAL_MAX_CELLS_OFFSET, sizeof(uint32_t));
+	if (internal_node_max_cells < INTERNAL_NODE_MIN_CELLS || internal_node_max_cells > pager->internal_node_max_cells) {
+		printf("db header has %d internal node cells. Corrupt file\n", internal_node_max_cells);
+		exit(EXIT_FAILURE);
+	}
+	pager->internal_node_max_cells = internal_node_max_cells;
+
+	if (pager->compressed) {
+		memcpy(&pager->num_pages, header + DB_NUM_PAGES_OFFSET, sizeof(uint32_t));
+		memcpy(pager->page_map, header + DB_PAGE_MAP_OFFSET, sizeof(pager->page_map));
+
+		pager_find_free_slots(pager);
+	}
+
+	if (!pager->compressed) {
+		if ((pager->file_length - DB_HEADER_SIZE) % pager->page_size != 0) {
+			printf("db file is not a whole number of pages. Corrupt file\n");
+			exit(EXIT_FAILURE);
+		}
+		pager->num_pages = (pager->file_length - DB_HEADER_SIZE) / pager->page_size;
+	}
+
+	if (pager->num_pages > TABLE_MAX_PAGES) {
+		printf("db file has %d pages, more than %d. Corrupt file\n", pager->num_pages, TABLE_MAX_PAGES);
+		exit(EXIT_FAILURE);
+	}
+}
+
+// page_map is NULL for plain files
+void build_header(uint8_t* header, uint32_t flags, uint32_t num_pages, uint32_t page_size, uint32_t internal_node_max_cells, PageMapEntry* page_map) {
+	memset(header, 0, DB_HEADER_SIZE);
+	memcpy(header, DB_MAGIC, DB_MAGIC_SIZE);
+	memcpy(header + DB_FLAGS_OFFSET, &flags, sizeof(uint32_t));
+	memcpy(header + DB_NUM_PAGES_OFFSET, &num_pages, sizeof(uint32_t));
+	memcpy(header + DB_PAGE_SIZE_OFFSET, &page_size, sizeof(uint32_t));
+	if (page_map != NULL) {
+		memcpy(header + DB_PAGE_MAP_OFFSET, page_map, TABLE_MAX_PAGES * sizeof(PageMapEntry));
+	}
+	memcpy(header + DB_VERSION_OFFSET, &DB_FORMAT_VERSION, sizeof(uint32_t));
+	memcpy(header + DB_INTERNAL_MAX_CELLS_OFFSET, &internal_node_max_cells, sizeof(uint32_t));
+	uint32_t checksum = ~crc32c_update(~0u, header, DB_HEADER_CHECKSUM_OFFSET);
+	memcpy(header + DB_HEADER_CHECKSUM_OFFSET, &checksum, sizeof(uint32_t));
+}
+
+void pager_write_header(Pager* pager) {
+	uint8_t* header = frame_alloc(&pager->frames);
+	uint32_t flags = (pager->compressed ? DB_FLAG_COMPRESSED : 0) | (pager->subtree_counts ? DB_FLAG_SUBTREE_COUNTS : 0);
+	build_header(header, flags, pager->num_pages, pager->page_size, pager->internal_node_max_cells, pager->compressed ? pager->page_map : NULL);
+
+	ssize_t res = pwrite(pager->file_descriptor, header, DB_HEADER_SIZE, 0);
+	if (res == -1) {
+		printf("error: %d::when try to write db header", errno);
+		exit(EXIT_FAILURE);
+	}
+	frame_free(&pager->frames, header);
+}
+
+int sync_file(int fd) {
+#ifdef __APPLE__
+	return fcntl(fd, F_FULLFSYNC);
+#else
+	return fdatasync(fd);
+#endif
+}
+
+void pager_sync(Pager* pager) {
+	if (sync_file(pager->file_descriptor) == -1) {
+		printf("error: %d::when try to sync db file", errno);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Direct io needs aligned buffers, offsets and lengths. Plain pages are whole
+ * aligned blocks read into frames, compressed slots are not, so they keep
+ * going through the page cache
+*/
+void pager_enable_direct_io(Pager* pager) {
+	if (pager->compressed) {
+		printf("direct io is not supported for compressed files\n");
+		exit(EXIT_FAILURE);
+	}
+
+#ifdef __APPLE__
+	int res = fcntl(pager->file_descriptor, F_NOCACHE, 1);
+#else
+	int res = fcntl(pager->file_descriptor, F_SETFL, fcntl(pager->file_descriptor, F_GETFL) | O_DIRECT);
+#endif
+	if (res == -1) {
+		printf("direct io is not supported for this file\n");
+		exit(EXIT_FAILURE);
+	}
+	pager->direct_io = true;
+}
+
+/*
+ * A journal left behind by a commit that did not finish, puts the pre-images
+ * back and cuts the file to the page count from before the transaction
+*/
+void pager_recover_journal(int fd, const char* journal_path) {
+	int journal_fd = open(journal_path, O_RDONLY);
+	if (journal_fd == -1) {
+		return;
+	}
+
+	uint8_t header[JOURNAL_HEADER_SIZE];
+	uint32_t page_size, num_pages, num_entries, checksum;
+	bool valid = pread(journal_fd, header, JOURNAL_HEADER_SIZE, 0) == JOURNAL_HEADER_SIZE
+		&& memcmp(header, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) == 0;
+	if (valid) {
+		memcpy(&page_size, header + JOURNAL_PAGE_SIZE_OFFSET, sizeof(uint32_t));
+		memcpy(&num_pages, header + JOURNAL_NUM_PAGES_OFFSET, sizeof(uint32_t));
+		memcpy(&num_entries, header + JOURNAL_NUM_ENTRIES_OFFSET, sizeof(uint32_t));
+		memcpy(&checksum, header + JOURNAL_CHECKSUM_OFFSET, sizeof(uint32_t));
+		valid = checksum == ~crc32c_update(~0u, header, JOURNAL_CHECKSUM_OFFSET) && is_valid_page_size(page_size);
+	}
+
+	uint32_t entry_size = valid ? sizeof(uint32_t) + page_size : 0;
+	uint8_t* entry = malloc(entry_size);
+
+	// the database is only written after the journal is synced, an entry that
+	// did not reach the disk means the database was never touched
+	for (uint32_t i = 0; valid && i < num_entries; i++) {
+		valid = pread(journal_fd, entry, entry_size, JOURNAL_HEADER_SIZE + (off_t)i * entry_size) == entry_size;
+		uint8_t* page = entry + sizeof(uint32_t);
+		uint32_t page_checksum;
+		memcpy(&page_checksum, page + page_size - PAGE_CHECKSUM_SIZE, sizeof(uint32_t));
+		valid = valid && page_checksum == ~crc32c_update(~0u, page, page_size - PAGE_CHECKSUM_SIZE);
+	}
+
+	if (valid) {
+		for (uint32_t i = 0; i < num_entries; i++) {
+			uint32_t page_num;
+			// the journal stays for the next open to retry
+			if (pread(journal_fd, entry, entry_size, JOURNAL_HEADER_SIZE + (off_t)i * entry_size) != (ssize_t)entry_size) {
+				printf("journal entry %d could not be read back. Corrupt journal\n", i);
+				exit(EXIT_FAILURE);
+			}
+			memcpy(&page_num, entry, sizeof(uint32_t));
+			if (pwrite(fd, entry + sizeof(uint32_t), page_size, DB_HEADER_SIZE + (off_t)page_num * page_size) == -1) {
+				printf("error: %d::when try to roll back page %d", errno, page_num);
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		if (ftruncate(fd, DB_HEADER_SIZE + (off_t)num_pages * page_size) == -1 || sync_file(fd) == -1) {
+			printf("error: %d::when try to roll back the journal", errno);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	free(entry);
+	close(journal_fd);
+	unlink(journal_path);
+}
+
+/*
+ * Files from before the header hold 4096 byte pages from offset 0, without
+ * checksums, and internal nodes without the row counts. They are rewritten
+ * next to the old file, which the new one then replaces, returns its descriptor
+*/
+const uint32_t HEADERLESS_PAGE_SIZE = 4096;
+const uint32_t HEADERLESS_INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + 2 * sizeof(uint32_t);
+const uint32_t HEADERLESS_INTERNAL_NODE_CELL_SIZE = 2 * sizeof(uint32_t);
+const uint32_t HEADERLESS_INTERNAL_NODE_MAX_CELLS = 3;
+
+int migrate_headerless_file(int fd, const char* filename) {
+	off_t file_length = lseek(fd, 0, SEEK_END);
+	uint8_t first[COMMON_NODE_HEADER_SIZE];
+	if (file_length == 0 || pread(fd, first, sizeof(first), 0) != (ssize_t)sizeof(first) || memcmp(first, DB_MAGIC, DB_MAGIC_SIZE) == 0) {
+		return fd;
+	}
+
+	// anything else is left for pager_read_header to refuse
+	uint32_t num_pages = file_length / HEADERLESS_PAGE_SIZE;
+	bool headerless = file_length % HEADERLESS_PAGE_SIZE == 0 && num_pages <= TABLE_MAX_PAGES
+		&& (get_node_type(first) == NODE_LEAF || get_node_type(first) == NODE_INTERNAL) && is_node_root(first);
+	if (!headerless) {
+		return fd;
+	}
+
+	uint8_t* old_page = malloc(HEADERLESS_PAGE_SIZE);
+	uint8_t* new_page = malloc(HEADERLESS_PAGE_SIZE);
+	char* migrated_path = malloc(strlen(filename) + sizeof("-migrated"));
+	sprintf(migrated_path, "%s-migrated", filename);
+	int migrated_fd = open(migrated_path, O_RDWR | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+	if (migrated_fd == -1) {
+		printf("unable to open %s\n", migrated_path);
+		exit(EXIT_FAILURE);
+	}
+
+	for (uint32_t i = 0; i < num_pages; i++) {
+		if (pread(fd, old_page, HEADERLESS_PAGE_SIZE, (off_t)i * HEADERLESS_PAGE_SIZE) != HEADERLESS_PAGE_SIZE) {
+			printf("error: %d::when try to migrate page %d", errno, i);
+			exit(EXIT_FAILURE);
+		}
+
+		memset(new_page, 0, HEADERLESS_PAGE_SIZE);
+		if (get_node_type(old_page) == NODE_LEAF) {
+			// leaves kept their layout, the checksum goes in space no cell reaches
+			memcpy(new_page, old_page, HEADERLESS_PAGE_SIZE);
+		} else {
+			memcpy(new_page, old_page, COMMON_NODE_HEADER_SIZE);
+			uint32_t num_keys;
+			memcpy(&num_keys, old_page + INTERNAL_NODE_NUM_KEYS_OFFSET, sizeof(uint32_t));
+			if (num_keys > HEADERLESS_INTERNAL_NODE_MAX_CELLS) {
+				printf("page %d has %d keys. Corrupt file\n", i, num_keys);
+				exit(EXIT_FAILURE);
+			}
+			*internal_node_num_keys(new_page) = num_keys;
+			memcpy(internal_node_right_child(new_page), old_page + INTERNAL_NODE_RIGHT_CHILD_OFFSET, sizeof(uint32_t));
+			for (uint32_t cell = 0; cell < num_keys; cell++) {
+				uint8_t* old_cell = old_page + HEADERLESS_INTERNAL_NODE_HEADER_SIZE + cell * HEADERLESS_INTERNAL_NODE_CELL_SIZE;
+				memcpy(internal_node_child(new_page, cell), old_cell, sizeof(uint32_t));
+				memcpy(internal_node_key(new_page, cell), old_cell + sizeof(uint32_t), sizeof(uint32_t));
+			}
+		}
+		uint32_t checksum = ~crc32c_update(~0u, new_page, HEADERLESS_PAGE_SIZE - PAGE_CHECKSUM_SIZE);
+		memcpy(new_page + HEADERLESS_PAGE_SIZE - PAGE_CHECKSUM_SIZE, &checksum, sizeof(uint32_t));
+
+		if (pwrite(migrated_fd, new_page, HEADERLESS_PAGE_SIZE, DB_HEADER_SIZE + (off_t)i * HEADERLESS_PAGE_SIZE) == -1) {
+			printf("error: %d::when try to migrate page %d", errno, i);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	build_header(new_page, 0, num_pages, HEADERLESS_PAGE_SIZE, internal_node_cells_for_page(HEADERLESS_PAGE_SIZE), NULL);
+	if (pwrite(migrated_fd, new_page, DB_HEADER_SIZE, 0) == -1 || sync_file(migrated_fd) == -1 || rename(migrated_path, filename) == -1) {
+		printf("error: %d::when try to migrate %s", errno, filename);
+		exit(EXIT_FAILURE);
+	}
+	printf("migrated %s to format version %d\n", filename, DB_FORMAT_VERSION);
+
+	close(fd);
+	free(old_page);
+	free(new_page);
+	free(migrated_path);
+	return migrated_fd;
+}
+
+Pager* pager_open(const char* filename, OpenOptions* options) {
+	int fd = open(filename,
+		     O_RDWR | O_CREAT,
+		     S_IWUSR | S_IRUSR
+		);
+	
+	if (fd == -1) {
+		printf("unable to open file\n");
+		exit(EXIT_FAILURE);
+	}
+
+	crc32c_init();
+
+	char* journal_path = malloc(strlen(filename) + sizeof("-journal"));
+	sprintf(journal_path, "%s-journal", filename);
+	pager_recover_journal(fd, journal_path);
+	fd = migrate_headerless_file(fd, filename);
+
+	off_t file_length = lseek(fd, 0, SEEK_END);
+
+	Pager* pager = malloc(sizeof(Pager));
+	pager->file_descriptor = fd;
+	pager->file_length = file_length;
+	pager->num_pages = 0;
+	pager->num_free_slots = 0;
+	pager->compress_buffer = NULL;
+	pager->direct_io = false;
+	pager->sync = options->sync;
+	memset(pager->page_map, 0, sizeof(pager->page_map));
+	memset(pager->dirty, 0, sizeof(pager->dirty));
+	memset(pager->journal, 0, sizeof(pager->journal));
+	pager->in_request = false;
+	memset(pager->undo, 0, sizeof(pager->undo));
+	pager->in_transaction = false;
+	pager->journal_path = journal_path;
+	pthread_mutex_init(&pager->lock, NULL);
+	pager->writeback_ratio = options->writeback_ratio;
+	pager->writeback_rate = options->writeback_rate;
+	pager->writeback_running = false;
+	pager->writeback_stop = false;
+	pager->pages_written_back = 0;
+	pthread_cond_init(&pager->writeback_wake, NULL);
+	pthread_mutex_init(&pager->write_lock, NULL);
+	pthread_mutex_init(&pager->io_lock, NULL);
+
+	if (file_length == 0) {
+		// new database, the header is written on close
+		pager->compressed = options->compress;
+		pager->subtree_counts = options->subtree_counts;
+		pager_set_page_size(pager, options->page_size);
+		if (options->internal_node_max_cells != 0) {
+			pager->internal_node_max_cells = options->internal_node_max_cells;
+		}
+		pager->file_length = DB_HEADER_SIZE;
+	} else {
+		pager_read_header(pager);
+	}
+
+	// a cache frame and a pre-image for every page, plus scratch
+	frame_pool_init(&pager->frames, 2 * TABLE_MAX_PAGES + FRAME_POOL_SCRATCH_FRAMES, pager->page_size);
+
+	if (pager->compressed) {
+		pager->compress_buffer = frame_alloc(&pager->frames);
+	}
+
+	if (options->direct_io) {
+		pager_enable_direct_io(pager);
+	}
+
+	for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) { 
+		pager->pages[i] = NULL;
+	}
+
+	return pager;
+}
+
+/*
+ * Compressed pages are rewritten in place while they fit in their slot,
+ * otherwise they move to a free slot or a new one at the end of the file.
+ * scratch is a page sized buffer for the compressed bytes, writeback passes its own
+*/
+void pager_flush_compressed(Pager* pager, uint32_t page_num, void* scratch) {
+	void* data = scratch;
+	uint32_t length = page_compress(pager->pages[page_num], pager->page_size, data, pager->page_size - 1);
+	if (length == 0) {
+		// incompressible, store the page as is
+		data = pager->pages[page_num];
+		length = pager->page_size;
+	}
+
+	// cache misses read the map under the same lock
+	pthread_mutex_lock(&pager->lock);
+	PageMapEntry* entry = &pager->page_map[page_num];
+	if (entry->offset == 0 || length > entry->capacity) {
+		entry->capacity = (length + COMPRESSED_SLOT_ALIGNMENT - 1) / COMPRESSED_SLOT_ALIGNMENT * COMPRESSED_SLOT_ALIGNMENT;
+		entry->offset = pager_allocate_slot(pager, entry->capacity);
+	}
+	entry->length = length;
+	off_t offset = entry->offset;
+	pthread_mutex_unlock(&pager->lock);
+
+	ssize_t res = pwrite(pager->file_descriptor, data, length, offset);
+	if (res == -1) {
+		printf("error: %d::when try to flush page %d", errno, page_num);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void pager_flush(Pager* pager, uint32_t page_num) {
+	if (pager->pages[page_num] == NULL) {
+		printf("trying to flush null page\n");
+		exit(EXIT_FAILURE);
+	}
+
+	*page_checksum(pager, pager->pages[page_num]) = compute_page_checksum(pager, pager->pages[page_num]);
+
+	if (pager->compressed) {
+		pager_flush_compressed(pager, page_num, pager->compress_buffer);
+		return;
+	}
+
+	off_t page_offset = lseek(pager->file_descriptor, DB_HEADER_SIZE + (off_t)page_num * pager->page_size, SEEK_SET);
+	if (page_offset == -1) {
+		printf("error seeking %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+
+  ssize_t res = write(pager->file_descriptor, pager->pages[page_num], pager->page_size);
+	if (res == -1) {
+		printf("error: %d::when try to flush page %d", errno, page_num);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void pager_flush_dirty(Pager* pager) {
+	pthread_mutex_lock(&pager->io_lock);
+	for (uint32_t i = 0; i < pager->num_pages; i++) {
+		if (pager->dirty[i]) {
+			pager_flush(pager, i);
+			pager->dirty[i] = 0;
+		}
+	}
+	pthread_mutex_unlock(&pager->io_lock);
+}
+
+/*
+ * Background writeback. Once more than writeback_ratio percent of the cached pages
+ * are dirty, a batch of them is copied out under write_lock and written without it,
+ * at most writeback_rate pages per second, so statements only wait for the copy and
+ * close only has the pages dirtied since the last round left to write.
+ * Pages of an open transaction stay in memory until commit.
+ * Compressed pages move around in the file, so they are flushed under the lock instead.
+ *
+ * Off unless --writeback-ratio is given. The pages it writes are not a snapshot of the
+ * tree: a session killed before close can leave a parent on disk that points to a
+ * child it never wrote, or a child whose split never reached the parent, and the
+ * checksums cannot tell. Without it, a killed session loses its changes since the last
+ * close or commit but leaves the file as that close or commit wrote it
+*/
+#define WRITEBACK_BATCH_PAGES 8
+const uint32_t WRITEBACK_INTERVAL_MS = 10;
+const uint32_t DEFAULT_WRITEBACK_RATIO = 100;
+const uint32_t DEFAULT_WRITEBACK_RATE = 1024;
+
+bool writeback_needed(Pager* pager) {
+	if (pager->in_transaction) {
+		return false;
+	}
+
+	uint32_t num_cached = 0;
+	uint32_t num_dirty = 0;
+	for (uint32_t i = 0; i < pager->num_pages; i++) {
+		if (pager->pages[i] != NULL) {
+			num_cached++;
+			num_dirty += pager->dirty[i];
+		}
+	}
+	return num_dirty > 0 && num_dirty * 100 > pager->writeback_ratio * num_cached;
+}
+
+void writeback_wait(Pager* pager, uint32_t ms) {
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += ms / 1000;
+	deadline.tv_nsec += (long)(ms % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&pager->writeback_wake, &pager->write_lock, &deadline);
+}
+
+void* writeback_thread(void* arg) {
+	Pager* pager = (Pager*)arg;
+	void* copies;
+	if (posix_memalign(&copies, FRAME_ALIGNMENT, WRITEBACK_BATCH_PAGES * pager->page_size) != 0) {
+		printf("unable to allocate writeback buffer\n");
+		exit(EXIT_FAILURE);
+	}
+	uint32_t batch[WRITEBACK_BATCH_PAGES];
+
+	pthread_mutex_lock(&pager->write_lock);
+	while (!pager->writeback_stop) {
+		if (!writeback_needed(pager)) {
+			writeback_wait(pager, WRITEBACK_INTERVAL_MS);
+			continue;
+		}
+
+		uint32_t num_batch = 0;
+		pthread_mutex_lock(&pager->io_lock);
+		for (uint32_t i = 0; i < pager->num_pages && num_batch < WRITEBACK_BATCH_PAGES; i++) {
+			if (!pager->dirty[i]) {
+				continue;
+			}
+			if (pager->compressed) {
+				// the first copy slot stands in for compress_buffer, which cache misses use
+				*page_checksum(pager, pager->pages[i]) = compute_page_checksum(pager, pager->pages[i]);
+				pager_flush_compressed(pager, i, copies);
+			} else {
+				void* copy = (char*)copies + num_batch * pager->page_size;
+				memcpy(copy, pager->pages[i], pager->page_size);
+				*page_checksum(pager, copy) = compute_page_checksum(pager, copy);
+			}
+			pager->dirty[i] = 0;
+			batch[num_batch++] = i;
+		}
+		pager->pages_written_back += num_batch;
+		pthread_mutex_unlock(&pager->write_lock);
+
+		if (!pager->compressed) {
+			for (uint32_t i = 0; i < num_batch; i++) {
+				off_t offset = DB_HEADER_SIZE + (off_t)batch[i] * pager->page_size;
+				if (pwrite(pager->file_descriptor, (char*)copies + i * pager->page_size, pager->page_size, offset) == -1) {
+					printf("error: %d::when try to write back page %d", errno, batch[i]);
+					exit(EXIT_FAILURE);
+				}
+			}
+		}
+		pthread_mutex_unlock(&pager->io_lock);
+
+		usleep((useconds_t)((uint64_t)num_batch * 1000000 / pager->writeback_rate));
+		pthread_mutex_lock(&pager->write_lock);
+	}
+	pthread_mutex_unlock(&pager->write_lock);
+
+	free(copies);
+	return NULL;
+}
+
+void pager_start_writeback(Pager* pager) {
+	if (pager->writeback_ratio >= 100) {
+		return;
+	}
+	if (pthread_create(&pager->writeback_thread, NULL, writeback_thread, pager) != 0) {
+		printf("unable to start writeback thread\n");
+		exit(EXIT_FAILURE);
+	}
+	pager->writeback_running = true;
+}
+
+void pager_stop_writeback(Pager* pager) {
+	if (!pager->writeback_running) {
+		return;
+	}
+	pthread_mutex_lock(&pager->write_lock);
+	pager->writeback_stop = true;
+	pthread_cond_signal(&pager->writeback_wake);
+	pthread_mutex_unlock(&pager->write_lock);
+	pthread_join(pager->writeback_thread, NULL);
+	pager->writeback_running = false;
+}
+
+/*
+ * Reads and verifies one page without touching the cache.
+ * scratch is a page sized buffer for the compressed bytes, so worker threads can pass their own
+*/
+PageReadResult pager_read_page(Pager* pager, uint32_t page_num, void* page, void* scratch) {
+	if (!pager->compressed) {
+		ssize_t bytes_read = pread(pager->file_descriptor, page, pager->page_size, DB_HEADER_SIZE + (off_t)page_num * pager->page_size);
+		if (bytes_read == -1) {
+			printf("Error reading file: %d\n", errno);
+			exit(EXIT_FAILURE);
+		}
+		if (bytes_read == 0) {
+			return PAGE_READ_NEW;
+		}
+		if (bytes_read != pager->page_size) {
+			return PAGE_READ_CORRUPT;
+		}
+	} else {
+		PageMapEntry* entry = &pager->page_map[page_num];
+		if (page_num >= pager->num_pages || entry->offset == 0) {
+			return PAGE_READ_NEW;
+		}
+
+		void* data = entry->length == pager->page_size ? page : scratch;
+		ssize_t bytes_read = pread(pager->file_descriptor, data, entry->length, entry->offset);
+		if (bytes_read == -1) {
+			printf("Error reading file: %d\n", errno);
+			exit(EXIT_FAILURE);
+		}
+		if (bytes_read != (ssize_t)entry->length) {
+			return PAGE_READ_CORRUPT;
+		}
+		if (data != page && !page_decompress(data, entry->length, page, pager->page_size)) {
+			return PAGE_READ_CORRUPT;
+		}
+	}
+
+	if (*page_checksum(pager, page) != compute_page_checksum(pager, page)) {
+		return PAGE_READ_BAD_CHECKSUM;
+	}
+
+	return PAGE_READ_SUCCESS;
+}
+
+/*
+ * Page errors end the process unless the thread armed page_error_jump, the server
+ * does for each request and answers it with the error instead. Pages are only read
+ * under write_lock, so the request is left holding it. A page that failed to load
+ * is not cached, every request that needs it fails the same way
+*/
+__thread jmp_buf* page_error_jump = NULL;
+
+_Noreturn void page_error_abort() {
+	if (page_error_jump == NULL) {
+		exit(EXIT_FAILURE);
+	}
+	longjmp(*page_error_jump, 1);
+}
+
+void* get_page(Pager* pager, uint32_t page_num) {
+  if (page_num >= TABLE_MAX_PAGES) {
+    printf("tried to fetch page number out of bounds. %d > %d\n", page_num, TABLE_MAX_PAGES);
+    page_error_abort();
+  }
+
+  void* page = __atomic_load_n(&pager->pages[page_num], __ATOMIC_ACQUIRE);
+  if (page != NULL) {
+    return page;
+  }
+
+  // cache miss
+  pthread_mutex_lock(&pager->lock);
+  if (pager->pages[page_num] == NULL) {
+    page = frame_alloc(&pager->frames);
+
+    switch (pager_read_page(pager, page_num, page, pager->compress_buffer)) {
+      case (PAGE_READ_SUCCESS):
+      case (PAGE_READ_NEW):
+        break;
+      case (PAGE_READ_BAD_CHECKSUM):
+        printf("page %d checksum mismatch. Corrupt file\n", page_num);
+        frame_free(&pager->frames, page);
+        pthread_mutex_unlock(&pager->lock);
+        page_error_abort();
+      case (PAGE_READ_CORRUPT):
+        printf("page %d could not be read. Corrupt file\n", page_num);
+        frame_free(&pager->frames, page);
+        pthread_mutex_unlock(&pager->lock);
+        page_error_abort();
+    }
+
+    __atomic_store_n(&pager->pages[page_num], page, __ATOMIC_RELEASE);
+
+    if (page_num >= pager->num_pages) {
+      pager->num_pages = page_num + 1;
+    }
+  }
+  page = pager->pages[page_num];
+  pthread_mutex_unlock(&pager->lock);
+
+  return page;
+}
+
+/*
+ * Every change to a page goes through here first. Inside a transaction the
+ * first change saves the page as it was, pages created by the transaction
+ * have no pre-image, they are dropped on rollback
+*/
+void* get_page_for_write(Pager* pager, uint32_t page_num) {
+	void* page = get_page(pager, page_num);
+	if (pager->in_transaction && page_num < pager->journal_num_pages && pager->journal[page_num] == NULL) {
+		pager->journal[page_num] = frame_alloc(&pager->frames);
+		memcpy(pager->journal[page_num], page, pager->page_size);
+	}
+	if (pager->in_request && page_num < pager->undo_num_pages && !pager->undo_saved[page_num]) {
+		if (pager->undo[page_num] == NULL) {
+			pager->undo[page_num] = malloc(pager->page_size);
+		}
+		memcpy(pager->undo[page_num], page, pager->page_size);
+		pager->undo_dirty[page_num] = pager->dirty[page_num];
+		pager->undo_saved[page_num] = true;
+	}
+	pager->dirty[page_num] = 1;
+	return page;
+}
+
+uint32_t get_unused_page_num(Pager* pager) {
+	return pager->num_pages;
+} 
+
+// the file is brought up to date first, so the pre-images match what is on disk
+void pager_begin(Pager* pager) {
+	pager_flush_dirty(pager);
+	pager_write_header(pager);
+	pager->in_transaction = true;
+	pager->journal_num_pages = pager->num_pages;
+}
+
+void pager_end_transaction(Pager* pager) {
+	for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
+		frame_free(&pager->frames, pager->journal[i]);
+		pager->journal[i] = NULL;
+	}
+	pager->in_transaction = false;
+}
+
+void pager_write_journal(Pager* pager) {
+	int fd = open(pager->journal_path, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+	if (fd == -1) {
+		printf("unable to open journal file\n");
+		exit(EXIT_FAILURE);
+	}
+
+	uint32_t entry_size = sizeof(uint32_t) + pager->page_size;
+	uint32_t num_entries = 0;
+	for (uint32_t i = 0; i < pager->journal_num_pages; i++) {
+		if (pager->journal[i] == NULL) {
+			continue;
+		}
+		off_t offset = JOURNAL_HEADER_SIZE + (off_t)num_entries * entry_size;
+		if (pwrite(fd, &i, sizeof(uint32_t), offset) == -1 || pwrite(fd, pager->journal[i], pager->page_size, offset + sizeof(uint32_t)) == -1) {
+			printf("error: %d::when try to write the journal", errno);
+			exit(EXIT_FAILURE);
+		}
+		num_entries++;
+	}
+
+	uint8_t header[JOURNAL_HEADER_SIZE];
+	memcpy(header, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+	memcpy(header + JOURNAL_PAGE_SIZE_OFFSET, &pager->page_size, sizeof(uint32_t));
+	memcpy(header + JOURNAL_NUM_PAGES_OFFSET, &pager->journal_num_pages, sizeof(uint32_t));
+	memcpy(header + JOURNAL_NUM_ENTRIES_OFFSET, &num_entries, sizeof(uint32_t));
+	uint32_t checksum = ~crc32c_update(~0u, header, JOURNAL_CHECKSUM_OFFSET);
+	memcpy(header + JOURNAL_CHECKSUM_OFFSET, &checksum, sizeof(uint32_t));
+
+	if (pwrite(fd, header, JOURNAL_HEADER_SIZE, 0) == -1) {
+		printf("error: %d::when try to write the journal", errno);
+		exit(EXIT_FAILURE);
+	}
+	if (pager->sync != SYNC_OFF && sync_file(fd) == -1) {
+		printf("error: %d::when try to sync the journal", errno);
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+}
+
+/*
+ * Journal, then the dirty set in one pass, then a single sync for the whole
+ * transaction. Compressed pages move around the file, their pre-images
+ * would not say where to go back to, so they are committed without a journal
+*/
+void pager_commit(Pager* pager) {
+	pager_write_journal(pager);
+
+	pager_flush_dirty(pager);
+	pager_write_header(pager);
+	if (pager->sync != SYNC_OFF) {
+		pager_sync(pager);
+	}
+
+	unlink(pager->journal_path);
+	pager_end_transaction(pager);
+}
+
+void pager_rollback(Pager* pager) {
+	for (uint32_t i = 0; i < pager->num_pages; i++) {
+		if (i >= pager->journal_num_pages) {
+			// created by the transaction
+			frame_free(&pager->frames, pager->pages[i]);
+			pager->pages[i] = NULL;
+		} else if (pager->journal[i] != NULL) {
+			memcpy(pager->pages[i], pager->journal[i], pager->page_size);
+		} else {
+			continue;
+		}
+		pager->dirty[i] = 0;
+	}
+
+	pager->num_pages = pager->journal_num_pages;
+	pager_end_transaction(pager);
+}
+
+void pager_begin_request(Pager* pager) {
+	memset(pager->undo_saved, 0, sizeof(pager->undo_saved));
+	pager->undo_num_pages = pager->num_pages;
+	pager->in_request = true;
+}
+
+void pager_end_request(Pager* pager) {
+	pager->in_request = false;
+}
+
+/*
+ * A page error can stop an insert half way, after a split already changed
+ * some pages. Puts those pages back as they were before the request, with
+ * their dirty bits, so close_db never flushes a half applied change
+*/
+void pager_undo_request(Pager* pager) {
+	for (uint32_t i = 0; i < pager->num_pages; i++) {
+		if (i >= pager->undo_num_pages) {
+			// created by the request
+			frame_free(&pager->frames, pager->pages[i]);
+			pager->pages[i] = NULL;
+			pager->dirty[i] = 0;
+		} else if (pager->undo_saved[i]) {
+			memcpy(pager->pages[i], pager->undo[i], pager->page_size);
+			pager->dirty[i] = pager->undo_dirty[i];
+		}
+	}
+
+	pager->num_pages = pager->undo_num_pages;
+	pager_end_request(pager);
+}
+
+uint32_t get_node_max_key(Pager* pager, void* node) {
+	if (get_node_type(node) == NODE_LEAF) {
+		return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+	}
+	void* right_child = get_page(pager, *internal_node_right_child(node));
+	return get_node_max_key(pager, right_child);
+}
+
+void create_new_root(Table* table, uint32_t right_child_page_num) {
+	/*
+	 * handle splitting the root.
+	 * old root copied to new page, becomes left child.
+	 * Address of right child passed in.
+	 * Re-initialize root page to contain the new root node.
+	 * New root node points to new children.
+	*/
+	void* root = get_page_for_write(table->pager, table->root_page_num);
+	void* right_child = get_page_for_write(table->pager, right_child_page_num);
+	uint32_t left_child_page_num = get_unused_page_num(table->pager);
+	void* left_child = get_page_for_write(table->pager, left_child_page_num);
+
+	if (get_node_type(root) == NODE_INTERNAL) {
+		initialize_internal_node(right_child);
+		initialize_internal_node(left_child);
+	}
+
+	/*
+	 * copy old root to left child
+	*/
+	memcpy(left_child, root, table->pager->page_size);
+	set_node_root(left_child, false);
+
+	if (get_node_type(left_child) == NODE_INTERNAL) {
+		void* child;
+		for (int i = 0; i < *internal_node_num_keys(left_child); i++) {
+			child = get_page_for_write(table->pager, *internal_node_child(left_child, i));
+			*node_parent(child) = left_child_page_num;
+		}
+		child = get_page_for_write(table->pager, *internal_node_right_child(left_child));
+		*node_parent(child) = left_child_page_num;
+	}
+
+	/*
+	 * The root node now is a internal node
+	*/
+	initialize_internal_node(root);
+	set_node_root(root, true);
+	*internal_node_num_keys(root) = 1;
+	*internal_node_child(root, 0) = left_child_page_num;
+	uint32_t left_child_max_key = get_node_max_key(table->pager, left_child);
+	*internal_node_key(root, 0) = left_child_max_key;
+	*internal_node_cell_count(root, 0) = node_row_count(left_child);
+	*internal_node_right_child(root) = right_child_page_num;
+	*internal_node_right_child_count(root) = node_row_count(right_child);
+	*node_parent(left_child) = table->root_page_num;
+	*node_parent(right_child) = table->root_page_num;
+}
+
+uint32_t internal_node_find_child(void* node, uint32_t key) {
+	uint32_t num_keys = *internal_node_num_keys(node);
+
+  // binary search
+	uint32_t start = 0;
+	uint32_t end = num_keys;
+	
+	while(start != end) {
+		uint32_t middle = (start + end) / 2;
+		uint32_t middle_key = *internal_node_key(node, middle);
+		if (middle_key >= key) {
+			end = middle;
+		} else {
+			start = middle + 1;
+		}
+	}
+
+	return start;
+}
+
+void update_internal_node_key(void* node, uint32_t old_key, uint32_t new_key) {
+	uint32_t old_child_index = internal_node_find_child(node, old_key);
+	*internal_node_key(node, old_child_index) = new_key;
+}
+
+void internal_node_split_and_insert(Table *table, uint32_t parent_page_num, uint32_t child_page_num) {
+	// save the old parent node context
+	uint32_t old_page_num = parent_page_num;
+	void* old_node = get_page_for_write(table->pager, parent_page_num);
+	uint32_t old_max = get_node_max_key(table->pager, old_node);
+
+	void* child_node = get_page_for_write(table->pager, child_page_num);
+	uint32_t child_max = get_node_max_key(table->pager, child_node);
+
+	uint32_t new_page_num = get_unused_page_num(table->pager);
+
+	uint32_t splitting_root = is_node_root(old_node);
+	void* parent;
+	void* new_node;
+	if (splitting_root) {
+		create_new_root(table, new_page_num);
+		parent = get_page_for_write(table->pager, table->root_page_num);
+		// we should update the old_node to point to the new root`s left child
+		old_page_num = *internal_node_child(parent, 0);
+		old_node = get_page_for_write(table->pager, old_page_num);
+	} else {
+		// if we are splitting a non root node, 
+		// we cannot insert our new node into the old node because it does not yet contain any keys
+		parent = get_page_for_write(table->pager, *node_parent(old_node));
+		new_node = get_page_for_write(table->pager, new_page_num);
+		initialize_internal_node(new_node);
+	}
+
+	uint32_t* old_num_keys = internal_node_num_keys(old_node);
+	uint32_t current_page_num = *internal_node_right_child(old_node);
+	void* current_node = get_page_for_write(table->pager, current_page_num);
+
+	// first put right child into new node and set right child of old node to invalid page number
+	internal_node_insert(table, new_page_num, current_page_num);
+	*node_parent(current_node) = new_page_num;
+	*internal_node_right_child(old_node) = INVALID_PAGE_NUM;
+
+	// for each key until you get to the middle key, move the key and the child to the new node
+	uint32_t max_cells = table->pager->internal_node_max_cells;
+	for (uint32_t i = max_cells - 1; i > max_cells / 2; i--) {
+		current_page_num = *internal_node_child(old_node, i);
+		current_node = get_page_for_write(table->pager, current_page_num);
+
+		internal_node_insert(table, new_page_num, current_page_num);
+		*node_parent(current_node) = new_page_num;
+
+		(*old_num_keys)--;
+	}
+
+	// set child before middle key, which is now the highest key, to be node`s right child
+	// and decrement number of keys
+	*internal_node_right_child(old_node) = *internal_node_child(old_node, *old_num_keys - 1);
+	*internal_node_right_child_count(old_node) = *internal_node_cell_count(old_node, *old_num_keys - 1);
+	(*old_num_keys)--;
+
+	uint32_t max_after_split = get_node_max_key(table->pager, old_node);
+	uint32_t destination_page_num = child_max < max_after_split ? old_page_num : new_page_num;
+
+	internal_node_insert(table, destination_page_num, child_page_num);
+	*node_parent(child_node) = destination_page_num;
+
+	update_internal_node_key(parent, old_max, max_after_split);
+	if (!splitting_root) {
+		// set before inserting, if the parent splits too it moves new_node and fixes the pointer
+		*node_parent(new_node) = *node_parent(old_node);
+		internal_node_insert(table, *node_parent(old_node), new_page_num);
+	}
+}
+
+void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t new_page_num) {
+	// Add a new child/key pair to parent that corresponds to child
+	void* parent = get_page_for_write(table->pager, parent_page_num);
+	void* child = get_page(table->pager, new_page_num);
+
+	// child max key to insert in the parent
+	uint32_t child_max_key = get_node_max_key(table->pager, child);
 	// position to insert the new child in the parent
 	uint32_t child_max_num = internal_node_find_child(parent, child_max_key);
 
 	uint32_t original_num_keys = *internal_node_num_keys(parent);
 
-	if (original_num_keys >= INTERNAL_NODE_MAX_CELLS) {
+	if (original_num_keys >= table->pager->internal_node_max_cells) {
 		internal_node_split_and_insert(table, parent_page_num, new_page_num);
 		return;
 	}
@@ -545,6 +1918,7 @@ void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t new_p
 	// An internal node with a right child of INVALID_PAGE_NUM is a empty node
 	if (right_child_page_num == INVALID_PAGE_NUM) {
 		*internal_node_right_child(parent) = new_page_num;
+		*internal_node_right_child_count(parent) = node_row_count(child);
 		return;
 	}
 
@@ -559,7 +1933,9 @@ void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t new_p
 	if (child_max_key > get_node_max_key(table->pager, right_child)) {
 		*internal_node_child(parent, original_num_keys) = right_child_page_num;
 		*internal_node_key(parent, original_num_keys) = get_node_max_key(table->pager, right_child);
+		*internal_node_cell_count(parent, original_num_keys) = *internal_node_right_child_count(parent);
 		*internal_node_right_child(parent) = new_page_num;
+		*internal_node_right_child_count(parent) = node_row_count(child);
 	} else {
 		for (uint32_t i = original_num_keys; i > child_max_num; i--) {
 			void* destination = internal_node_cell(parent, i);
@@ -569,6 +1945,7 @@ void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t new_p
 
 		*internal_node_child(parent, child_max_num) = new_page_num;
 		*internal_node_key(parent, child_max_num) = child_max_key;
+		*internal_node_cell_count(parent, child_max_num) = node_row_count(child);
 	}
 }
 
@@ -577,10 +1954,12 @@ void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t new_p
  * Nem node will inserted in one of the two nodes.
 */
 void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
-	void* old_node = get_page(cursor->table->pager, cursor->page_num); // root
+	Pager* pager = cursor->table->pager;
+	cursor->table->last_leaf.valid = false;
+	void* old_node = get_page_for_write(cursor->table->pager, cursor->page_num); // root
 	uint32_t old_max = get_node_max_key(cursor->table->pager, old_node); // 5
 	uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
-	void* new_node = get_page(cursor->table->pager, new_page_num);
+	void* new_node = get_page_for_write(cursor->table->pager, new_page_num);
 	initialize_leaf_node(new_node); // new 5 node
 	*node_parent(new_node) = *node_parent(old_node); // receive the root as parent
   *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
@@ -589,15 +1968,17 @@ void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
 	/*
 	 * all key plus new key should be divided between left (old) and right (new) nodes
 	*/
-	for (int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--) {
+	for (int32_t i = pager->leaf_node_max_cells; i >= 0; i--) {
 		void* destination_node;
-		if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) {
+		uint32_t node_indexed;
+		if (i >= pager->leaf_node_left_split_count) {
 			destination_node = new_node;
+			node_indexed = i - pager->leaf_node_left_split_count;
 		} else {
 			destination_node = old_node;
+			node_indexed = i;
 		}
 
-		uint32_t node_indexed = i % LEAF_NODE_LEFT_SPLIT_COUNT;
 		void* destination = leaf_node_cell(destination_node, node_indexed);
 
 		if (i == cursor->cell_num) {
@@ -611,14 +1992,14 @@ void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
 	}
 
 	/* Update header cell count */
-	*(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-	*(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+	*(leaf_node_num_cells(old_node)) = pager->leaf_node_left_split_count;
+	*(leaf_node_num_cells(new_node)) = pager->leaf_node_right_split_count;
 	
 	if (is_node_root(old_node)) {
 		return create_new_root(cursor->table, new_page_num);
 	} else {
 		uint32_t parent_page_num = *node_parent(old_node);
-		void* parent = get_page(cursor->table->pager, parent_page_num);
+		void* parent = get_page_for_write(cursor->table->pager, parent_page_num);
 
 		// update parent node with max key of old left leaf node
 		uint32_t new_max = get_node_max_key(cursor->table->pager, old_node);
@@ -630,10 +2011,10 @@ void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
 }
 
 void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value) {
-  void* node = get_page(cursor->table->pager, cursor->page_num);
+  void* node = get_page_for_write(cursor->table->pager, cursor->page_num);
   uint32_t num_cells = *leaf_node_num_cells(node);
 	
-  if (num_cells >= LEAF_NODE_MAX_CELLS) {
+  if (num_cells >= cursor->table->pager->leaf_node_max_cells) {
     leaf_node_split_and_insert(cursor, key, value);
     return;
   }
@@ -651,7 +2032,7 @@ Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key) {
 	void* node = get_page(table->pager, page_num);
 	uint32_t num_cells = *leaf_node_num_cells(node);
 	
-	Cursor* cursor = malloc(sizeof(Cursor));
+	Cursor* cursor = arena_alloc(&table->scratch, sizeof(Cursor));
 	cursor->table = table;
 	cursor->page_num = page_num;
 
@@ -678,35 +2059,243 @@ Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key) {
 	return cursor;
 }
 
-Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key) {
+/* 
+ * Return the position of the give key
+ * If the key is not present, return the position where it should be inserted.
+ * Keys inside the range of the last leaf skip the descent, clustered
+ * lookups and appends mostly land there
+*/
+Cursor* table_find_by_key(Table* table, uint32_t key) {
+	table->lookups++;
+
+	LeafHint* hint = &table->last_leaf;
+	if (hint->valid && key > hint->lower_bound && key <= hint->upper_bound) {
+		table->hint_hits++;
+		return leaf_node_find(table, hint->page_num, key);
+	}
+
+	// child i holds the keys above separator i - 1 up to separator i
+	uint32_t page_num = table->root_page_num;
 	void* node = get_page(table->pager, page_num);
+	int64_t lower_bound = -1;
+	int64_t upper_bound = UINT32_MAX;
+	while (get_node_type(node) == NODE_INTERNAL) {
+		uint32_t child = internal_node_find_child(node, key);
+		if (child > 0) {
+			lower_bound = *internal_node_key(node, child - 1);
+		}
+		if (child < *internal_node_num_keys(node)) {
+			upper_bound = *internal_node_key(node, child);
+		}
+		page_num = *internal_node_child(node, child);
+		node = get_page(table->pager, page_num);
+	}
+
+	*hint = (LeafHint){ true, page_num, lower_bound, upper_bound };
+	return leaf_node_find(table, page_num, key);
+}
 
-	uint32_t child_index = internal_node_find_child(node, key);
-	uint32_t child_num = *internal_node_child(node, child_index);
+/*
+ * Refreshes the subtree counts on the path from the root to the leaf of key
+ * after an insert, returns the row count of the node.
+ * A split only moves rows between a node and its new sibling, which sit next
+ * to each other in the parent, so besides the path child only its neighbours
+ * can be stale. When the parent splits as well the pair can end up under
+ * different parents, so inside a neighbour the stale count is the one on its
+ * edge facing key, which is where key routes to. O(depth^2) pages at worst,
+ * all already visited by the insert.
+*/
+uint32_t update_subtree_counts(Pager* pager, uint32_t page_num, uint32_t key, bool neighbours) {
+	void* node = get_page(pager, page_num);
+	if (get_node_type(node) == NODE_LEAF) {
+		return *leaf_node_num_cells(node);
+	}
+
+	get_page_for_write(pager, page_num);
+	uint32_t num_keys = *internal_node_num_keys(node);
+	uint32_t path_child = internal_node_find_child(node, key);
+	uint32_t first = neighbours && path_child > 0 ? path_child - 1 : path_child;
+	uint32_t last = neighbours && path_child < num_keys ? path_child + 1 : path_child;
+
+	for (uint32_t i = first; i <= last; i++) {
+		uint32_t child_page_num = *internal_node_child(node, i);
+		*internal_node_child_count(node, i) = update_subtree_counts(pager, child_page_num, key, neighbours && i == path_child);
+	}
+
+	return node_row_count(node);
+}
 
-	void* child = get_page(table->pager, child_num);
-	switch (get_node_type(child)) {
-		case NODE_LEAF:
-			return leaf_node_find(table, child_num, key);
-		case NODE_INTERNAL:
-			return internal_node_find(table, child_num, key);
+uint32_t leftmost_leaf(Pager* pager, uint32_t page_num) {
+	void* node = get_page(pager, page_num);
+	while (get_node_type(node) == NODE_INTERNAL) {
+		page_num = *internal_node_child(node, 0);
+		node = get_page(pager, page_num);
 	}
+	return page_num;
 }
 
-/* 
- * Return the position of the give key
- * If the key is not present, return the position where it should be inserted
+uint64_t table_row_count(Table* table) {
+	Pager* pager = table->pager;
+	if (pager->subtree_counts) {
+		return node_row_count(get_page(pager, table->root_page_num));
+	}
+
+	uint64_t count = 0;
+	uint32_t page_num = leftmost_leaf(pager, table->root_page_num);
+	do {
+		void* node = get_page(pager, page_num);
+		count += *leaf_node_num_cells(node);
+		page_num = *leaf_node_next_leaf(node);
+	} while (page_num != 0);
+	return count;
+}
+
+/*
+ * Cursor at the row with the given position in key order.
+ * With subtree counts the descent skips whole children in O(depth),
+ * otherwise it skips whole leaves along the leaf chain
 */
-Cursor* table_find_by_key(Table* table, uint32_t key) {
-	uint32_t root_page_num = table->root_page_num;
-	void* root_node = get_page(table->pager, root_page_num);
+Cursor* table_find_by_position(Table* table, uint64_t position) {
+	Pager* pager = table->pager;
+	Cursor* cursor = arena_alloc(&table->scratch, sizeof(Cursor));
+	cursor->table = table;
+	cursor->end_of_table = false;
+
+	uint32_t page_num = table->root_page_num;
+	void* node = get_page(pager, page_num);
+
+	if (pager->subtree_counts) {
+		while (get_node_type(node) == NODE_INTERNAL) {
+			uint32_t num_keys = *internal_node_num_keys(node);
+			uint32_t child = 0;
+			while (child < num_keys && position >= *internal_node_child_count(node, child)) {
+				position -= *internal_node_child_count(node, child);
+				child++;
+			}
+			page_num = *internal_node_child(node, child);
+			node = get_page(pager, page_num);
+		}
+	} else {
+		page_num = leftmost_leaf(pager, page_num);
+		node = get_page(pager, page_num);
+		while (position >= *leaf_node_num_cells(node) && *leaf_node_next_leaf(node) != 0) {
+			position -= *leaf_node_num_cells(node);
+			page_num = *leaf_node_next_leaf(node);
+			node = get_page(pager, page_num);
+		}
+	}
+
+	cursor->page_num = page_num;
+	cursor->cell_num = position;
+	cursor->end_of_table = position >= *leaf_node_num_cells(node);
+	return cursor;
+}
+
+/*
+ * Number of rows with an id lower than key
+*/
+uint64_t table_rank(Table* table, uint64_t key) {
+	if (key > UINT32_MAX) {
+		return table_row_count(table);
+	}
+
+	Pager* pager = table->pager;
+	Cursor* cursor = table_find_by_key(table, key);
+	uint64_t rank = cursor->cell_num;
+
+	if (pager->subtree_counts) {
+		// add the children left of the path on the way down
+		void* node = get_page(pager, table->root_page_num);
+		while (get_node_type(node) == NODE_INTERNAL) {
+			uint32_t child = internal_node_find_child(node, key);
+			for (uint32_t i = 0; i < child; i++) {
+				rank += *internal_node_cell_count(node, i);
+			}
+			node = get_page(pager, *internal_node_child(node, child));
+		}
+	} else {
+		uint32_t page_num = leftmost_leaf(pager, table->root_page_num);
+		while (page_num != cursor->page_num) {
+			void* node = get_page(pager, page_num);
+			rank += *leaf_node_num_cells(node);
+			page_num = *leaf_node_next_leaf(node);
+		}
+	}
+
+	return rank;
+}
+
+/*
+ * Sized for the most keys the file can hold, 10 bits and 7 probes per key
+ * keep false positives under 1% when it is full
+*/
+const uint32_t BLOOM_BITS_PER_KEY = 10;
+const uint32_t BLOOM_NUM_PROBES = 7;
+
+uint64_t bloom_hash(uint32_t key) {
+	uint64_t h = key;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+void bloom_add(BloomFilter* bloom, uint32_t key) {
+	uint64_t h = bloom_hash(key);
+	uint32_t h1 = (uint32_t)h;
+	uint32_t h2 = (uint32_t)(h >> 32) | 1;
+	for (uint32_t i = 0; i < BLOOM_NUM_PROBES; i++) {
+		uint32_t bit = (h1 + i * h2) % bloom->num_bits;
+		bloom->bits[bit / 8] |= 1 << (bit % 8);
+	}
+}
+
+bool bloom_may_contain(BloomFilter* bloom, uint32_t key) {
+	if (bloom->bits == NULL) {
+		return true;
+	}
+
+	uint64_t h = bloom_hash(key);
+	uint32_t h1 = (uint32_t)h;
+	uint32_t h2 = (uint32_t)(h >> 32) | 1;
+	for (uint32_t i = 0; i < BLOOM_NUM_PROBES; i++) {
+		uint32_t bit = (h1 + i * h2) % bloom->num_bits;
+		if (!(bloom->bits[bit / 8] & (1 << (bit % 8)))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void bloom_build(Table* table) {
+	Pager* pager = table->pager;
+	BloomFilter* bloom = &table->bloom;
+	bloom->num_bits = TABLE_MAX_PAGES * pager->leaf_node_max_cells * BLOOM_BITS_PER_KEY;
+	bloom->bits = calloc((bloom->num_bits + 7) / 8, 1);
+
+	uint32_t page_num = leftmost_leaf(pager, table->root_page_num);
+	do {
+		void* node = get_page(pager, page_num);
+		uint32_t num_cells = *leaf_node_num_cells(node);
+		for (uint32_t i = 0; i < num_cells; i++) {
+			bloom_add(bloom, *leaf_node_key(node, i));
+		}
+		page_num = *leaf_node_next_leaf(node);
+	} while (page_num != 0);
+}
 
-	if (get_node_type(root_node) == NODE_LEAF) {
-		return leaf_node_find(table, root_page_num, key);
+bool table_contains(Table* table, uint32_t key) {
+	if (!bloom_may_contain(&table->bloom, key)) {
+		table->bloom.negatives++;
+		return false;
 	}
 
-	return internal_node_find(table, root_page_num, key);
-} 
+	Cursor* cursor = table_find_by_key(table, key);
+	void* node = get_page(table->pager, cursor->page_num);
+	return cursor->cell_num < *leaf_node_num_cells(node) && *leaf_node_key(node, cursor->cell_num) == key;
+}
 
 void* cursor_value(Cursor* cursor) {
 	void* page = get_page(cursor->table->pager, cursor->page_num);
@@ -744,38 +2333,262 @@ void advance_cursor(Cursor* cursor) {
 	}
 }
 
+/*
+ * Runs fn over every task on a small pool of worker threads.
+ * Workers pull the next task index, so uneven tasks still balance out
+*/
+#define MAX_WORKER_THREADS 16
+
+typedef void (*ParallelTaskFn)(void* task);
+
+typedef struct {
+	uint8_t* tasks;
+	size_t task_size;
+	uint32_t num_tasks;
+	uint32_t next_task;
+	ParallelTaskFn fn;
+	bool abortable; // the caller armed page_error_jump
+	bool aborted;
+} ParallelJob;
+
+void* parallel_worker(void* arg) {
+	ParallelJob* job = arg;
+
+	// a page error ends this worker, run_parallel passes it on to the caller after the join
+	jmp_buf* caller_jump = page_error_jump;
+	jmp_buf jump;
+	if (job->abortable) {
+		if (setjmp(jump) != 0) {
+			__atomic_store_n(&job->aborted, true, __ATOMIC_RELAXED);
+			page_error_jump = caller_jump;
+			return NULL;
+		}
+		page_error_jump = &jump;
+	}
+
+	uint32_t i;
+	while (!__atomic_load_n(&job->aborted, __ATOMIC_RELAXED) && (i = __atomic_fetch_add(&job->next_task, 1, __ATOMIC_RELAXED)) < job->num_tasks) {
+		job->fn(job->tasks + i * job->task_size);
+	}
+	page_error_jump = caller_jump;
+	return NULL;
+}
+
+uint32_t worker_threads() {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1) return 1;
+	return cpus < MAX_WORKER_THREADS ? cpus : MAX_WORKER_THREADS;
+}
+
+void run_parallel(void* tasks, size_t task_size, uint32_t num_tasks, ParallelTaskFn fn) {
+	ParallelJob job = { tasks, task_size, num_tasks, 0, fn, page_error_jump != NULL, false };
+	uint32_t num_threads = worker_threads();
+	if (num_threads > num_tasks) {
+		num_threads = num_tasks;
+	}
+
+	// the calling thread is one of the workers
+	pthread_t threads[MAX_WORKER_THREADS];
+	uint32_t started = 0;
+	for (; started + 1 < num_threads; started++) {
+		if (pthread_create(&threads[started], NULL, parallel_worker, &job) != 0) {
+			break;
+		}
+	}
+	parallel_worker(&job);
+	for (uint32_t i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	if (job.aborted) {
+		page_error_abort();
+	}
+}
+
+typedef struct {
+	char* data;
+	size_t length;
+	size_t capacity;
+} OutputBuffer;
+
+void output_buffer_append_row(OutputBuffer* output, Row* r) {
+	// worst case for one formatted row
+	size_t needed = ROW_SIZE + 32;
+	if (output->length + needed > output->capacity) {
+		output->capacity = output->capacity == 0 ? 64 * 1024 : output->capacity * 2;
+		output->data = realloc(output->data, output->capacity);
+	}
+	output->length += sprintf(output->data + output->length, "(%d, %s, %s)\n", r->id, r->username, r->email);
+}
+
+/*
+ * Parallel full-table scan.
+ * The tree is cut into key ranges at the first level with enough subtrees,
+ * each range is the run of leaves from the leftmost leaf of one subtree up to
+ * the leftmost leaf of the next, walked by its own cursor on a worker thread.
+ * Finished ranges are written in key order as soon as every range before
+ * them is out, or as they finish when the order does not matter.
+*/
+const uint32_t SCAN_PARTITIONS_PER_THREAD = 4;
+
+typedef struct ScanJob ScanJob;
+
+typedef struct {
+	ScanJob* job;
+	uint32_t start_page;
+	uint32_t end_page; // first leaf of the next range, 0 for the last one
+	OutputBuffer output;
+	bool done;
+} ScanTask;
+
+struct ScanJob {
+	Table* table;
+	bool ordered;
+	ScanTask* tasks;
+	uint32_t num_tasks;
+	uint32_t next_to_write;
+	pthread_mutex_t lock;
+};
+
+/*
+ * Fills subtrees with the page numbers of the first tree level that has at least
+ * min_subtrees nodes (or the leaves), in key order
+*/
+uint32_t scan_partition_subtrees(Table* table, uint32_t* subtrees, uint32_t min_subtrees) {
+	Pager* pager = table->pager;
+	uint32_t* level = malloc(sizeof(uint32_t) * TABLE_MAX_PAGES);
+	uint32_t num_subtrees = 1;
+	subtrees[0] = table->root_page_num;
+
+	while (num_subtrees < min_subtrees && get_node_type(get_page(pager, subtrees[0])) == NODE_INTERNAL) {
+		uint32_t level_size = 0;
+		for (uint32_t i = 0; i < num_subtrees; i++) {
+			void* node = get_page(pager, subtrees[i]);
+			uint32_t num_keys = *internal_node_num_keys(node);
+			for (uint32_t child = 0; child <= num_keys; child++) {
+				level[level_size++] = *internal_node_child(node, child);
+			}
+		}
+		memcpy(subtrees, level, sizeof(uint32_t) * level_size);
+		num_subtrees = level_size;
+	}
+
+	free(level);
+	return num_subtrees;
+}
+
+void scan_write_output(ScanTask* task) {
+	fwrite(task->output.data, 1, task->output.length, stdout);
+	free(task->output.data);
+	task->output = (OutputBuffer){ NULL, 0, 0 };
+}
+
+void scan_range(void* arg) {
+	ScanTask* task = arg;
+	ScanJob* job = task->job;
+
+	Cursor cursor = { job->table, task->start_page, 0, false };
+	void* node = get_page(job->table->pager, cursor.page_num);
+	cursor.end_of_table = *leaf_node_num_cells(node) == 0;
+
+	Row r;
+	while (!cursor.end_of_table && cursor.page_num != task->end_page) {
+		deserialize_row(cursor_value(&cursor), &r);
+		output_buffer_append_row(&task->output, &r);
+		advance_cursor(&cursor);
+	}
+
+	pthread_mutex_lock(&job->lock);
+	task->done = true;
+	if (!job->ordered) {
+		scan_write_output(task);
+	} else {
+		while (job->next_to_write < job->num_tasks && job->tasks[job->next_to_write].done) {
+			scan_write_output(&job->tasks[job->next_to_write++]);
+		}
+	}
+	pthread_mutex_unlock(&job->lock);
+}
+
+/*
+ * Returns false when the table is too small to split, the caller scans it serially
+*/
+bool table_scan_parallel(Table* table, bool ordered) {
+	uint32_t* subtrees = malloc(sizeof(uint32_t) * TABLE_MAX_PAGES);
+	uint32_t num_subtrees = scan_partition_subtrees(table, subtrees, worker_threads() * SCAN_PARTITIONS_PER_THREAD);
+	if (num_subtrees < 2) {
+		free(subtrees);
+		return false;
+	}
+
+	ScanJob job = { table, ordered, calloc(num_subtrees, sizeof(ScanTask)), num_subtrees, 0, PTHREAD_MUTEX_INITIALIZER };
+
+	for (uint32_t i = 0; i < num_subtrees; i++) {
+		job.tasks[i].job = &job;
+		job.tasks[i].start_page = leftmost_leaf(table->pager, subtrees[i]);
+	}
+	for (uint32_t i = 0; i < num_subtrees; i++) {
+		job.tasks[i].end_page = i + 1 < num_subtrees ? job.tasks[i + 1].start_page : 0;
+	}
+
+	run_parallel(job.tasks, sizeof(ScanTask), num_subtrees, scan_range);
+
+	pthread_mutex_destroy(&job.lock);
+	free(job.tasks);
+	free(subtrees);
+	return true;
+}
+
 void print_prompt() {
 	printf("db > ");
 }
 
-Table* open_db(const char* filename) {
-	Pager* pager = pager_open(filename);
+Table* open_db(const char* filename, OpenOptions* options) {
+	Pager* pager = pager_open(filename, options);
 
 	Table* table = (Table*)malloc(sizeof(Table));
 	table->root_page_num = 0;
 	table->pager = pager;
+	table->scratch.chunks = NULL;
+	table->last_leaf.valid = false;
+	table->lookups = 0;
+	table->hint_hits = 0;
+	table->bloom.bits = NULL;
+	table->bloom.negatives = 0;
 
 	if (pager->num_pages == 0) {
 		// new database file, initialize page 0 as leaf node
-		void* root_node = get_page(pager, 0);
+		void* root_node = get_page_for_write(pager, 0);
 		initialize_leaf_node(root_node);
 		set_node_root(root_node, true);
 	}
 
+	if (options->bloom) {
+		bloom_build(table);
+	}
+
+	pager_start_writeback(pager);
+
 	return table;
 }
 
 void close_db(Table* table) {
 	Pager* pager = table->pager;
 
-	for (uint32_t i = 0; i < pager->num_pages; i++) {
-		if (pager->pages[i] == NULL) {
-			continue;
-		}
+	pager_stop_writeback(pager);
 
-		pager_flush(pager, i);
-		free(pager->pages[i]);
-		pager->pages[i] = NULL;
+	// a transaction that was never committed is discarded
+	if (pager->in_transaction) {
+		pager_rollback(pager);
+	}
+
+	pager_flush_dirty(pager);
+
+	if (pager->sync == SYNC_FULL) {
+		pager_sync(pager);
+	}
+	pager_write_header(pager);
+	if (pager->sync != SYNC_OFF) {
+		pager_sync(pager);
 	}
 
 	if (close(pager->file_descriptor) == -1) {
@@ -783,15 +2596,19 @@ void close_db(Table* table) {
 		exit(EXIT_FAILURE);
 	}
 
- for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    void* page = pager->pages[i];
-    if (page) {
-      free(page);
-      pager->pages[i] = NULL;
-    }
-  }
-
+	// frames, the compression buffer included, go back with the pool
+	frame_pool_destroy(&pager->frames);
+	pthread_mutex_destroy(&pager->lock);
+	pthread_mutex_destroy(&pager->write_lock);
+	pthread_mutex_destroy(&pager->io_lock);
+	pthread_cond_destroy(&pager->writeback_wake);
+	free(pager->journal_path);
+	for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
+		free(pager->undo[i]);
+	}
 	free(pager);
+	free(table->bloom.bits);
+	arena_free(&table->scratch);
 }
 
 void read_input(InputBuffer *input_buffer) {
@@ -812,35 +2629,584 @@ void indent(uint32_t level) {
 	}
 }
 
-void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
-	void* node = get_page(pager, page_num);
-	uint32_t num_keys, child;
+void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
+	void* node = get_page(pager, page_num);
+	uint32_t num_keys, child;
+
+	switch (get_node_type(node)) {
+		case (NODE_LEAF):
+			num_keys = *leaf_node_num_cells(node);
+			indent(indentation_level);
+			printf("- leaf (size %d)\n", num_keys);
+			for (uint32_t i = 0; i < num_keys; i++) {
+				indent(indentation_level + 1);
+				printf("- %d\n", *leaf_node_key(node, i));
+			}
+			break;
+		case (NODE_INTERNAL):
+			num_keys = *internal_node_num_keys(node);
+			indent(indentation_level);
+			printf("- internal (size %d)\n", num_keys);
+			for (uint32_t i = 0; i < num_keys; i++) {
+				child = *internal_node_child(node, i);
+				print_tree(pager, child, indentation_level + 1);
+
+				indent(indentation_level + 1);
+				printf("- key %d\n", *internal_node_key(node, i));
+			}
+			child = *internal_node_right_child(node);
+			print_tree(pager, child, indentation_level + 1);
+			break;	
+	}
+}
+
+/*
+ * .check, an integrity scan of the whole file.
+ * Phase 1 verifies the checksums of the pages on disk in parallel page ranges,
+ * loading the ones that are not cached yet.
+ * Phase 2 walks the subtrees under the root in parallel, validating key order,
+ * parent pointers and separator keys, then the leaf chain is compared with the
+ * leaves found in key order.
+*/
+typedef enum {
+	CHECK_BAD_CHECKSUM = 1 << 0,
+	CHECK_UNREADABLE = 1 << 1,
+	CHECK_MALFORMED_NODE = 1 << 2,
+	CHECK_KEY_ORDER = 1 << 3,
+	CHECK_PARENT_POINTER = 1 << 4,
+	CHECK_SEPARATOR = 1 << 5,
+	CHECK_LEAF_DEPTH = 1 << 6,
+	CHECK_LEAF_CHAIN = 1 << 7,
+	CHECK_UNREACHABLE = 1 << 8,
+	CHECK_SUBTREE_COUNT = 1 << 9
+} CheckError;
+
+const char* CHECK_ERROR_MESSAGES[] = {
+	"checksum mismatch",
+	"unreadable page",
+	"malformed node",
+	"keys out of order",
+	"wrong parent pointer",
+	"separator key is not the max key of its child",
+	"leaf at a different depth",
+	"broken leaf chain",
+	"unreachable page",
+	"subtree count does not match its rows",
+};
+const uint32_t CHECK_NUM_ERRORS = sizeof(CHECK_ERROR_MESSAGES) / sizeof(CHECK_ERROR_MESSAGES[0]);
+const uint32_t CHECK_PAGES_PER_TASK = 16;
+const uint32_t CHECK_NO_LEAF_DEPTH = UINT32_MAX;
+
+typedef struct {
+	Pager* pager;
+	uint32_t root_page_num;
+	uint32_t errors[TABLE_MAX_PAGES]; // CheckError bits, each page is written by one thread only
+	uint8_t visited[TABLE_MAX_PAGES];
+	uint32_t pages_verified;
+} CheckContext;
+
+typedef struct {
+	CheckContext* context;
+	uint32_t first_page;
+	uint32_t end_page;
+} CheckPagesTask;
+
+typedef struct {
+	CheckContext* context;
+	uint32_t page_num;
+	uint32_t parent_page_num;
+	uint32_t depth;
+	int64_t lower_bound; // exclusive, -1 when there is none
+	int64_t upper_bound; // inclusive
+	int64_t max_key;
+	uint32_t leaves[TABLE_MAX_PAGES]; // in key order
+	uint32_t num_leaves;
+	uint32_t leaf_depth;
+	uint64_t num_rows;
+	bool incomplete; // some rows below could not be counted
+} CheckTreeTask;
+
+void check_pages(void* arg) {
+	CheckPagesTask* task = arg;
+	CheckContext* context = task->context;
+	Pager* pager = context->pager;
+	void* scratch = frame_alloc(&pager->frames);
+	uint32_t verified = 0;
+
+	for (uint32_t i = task->first_page; i < task->end_page; i++) {
+		// cached pages were verified when loaded, or changed since
+		if (pager->pages[i] != NULL) {
+			continue;
+		}
+
+		void* page = frame_alloc(&pager->frames);
+		switch (pager_read_page(pager, i, page, scratch)) {
+			case (PAGE_READ_SUCCESS):
+				verified++;
+				__atomic_store_n(&pager->pages[i], page, __ATOMIC_RELEASE);
+				continue;
+			case (PAGE_READ_NEW):
+				context->errors[i] |= CHECK_UNREADABLE;
+				break;
+			case (PAGE_READ_BAD_CHECKSUM):
+				verified++;
+				context->errors[i] |= CHECK_BAD_CHECKSUM;
+				break;
+			case (PAGE_READ_CORRUPT):
+				context->errors[i] |= CHECK_UNREADABLE;
+				break;
+		}
+		frame_free(&pager->frames, page);
+	}
+
+	frame_free(&pager->frames, scratch);
+	__atomic_fetch_add(&context->pages_verified, verified, __ATOMIC_RELAXED);
+}
+
+void check_tree_merge(CheckTreeTask* task, CheckTreeTask* child) {
+	CheckContext* context = task->context;
+	if (child->num_leaves == 0) {
+		return;
+	}
+	if (child->leaf_depth == CHECK_NO_LEAF_DEPTH) {
+		// nothing readable below this child
+	} else if (task->leaf_depth == CHECK_NO_LEAF_DEPTH) {
+		task->leaf_depth = child->leaf_depth;
+	} else if (child->leaf_depth != task->leaf_depth) {
+		context->errors[child->page_num] |= CHECK_LEAF_DEPTH;
+	}
+	memcpy(task->leaves + task->num_leaves, child->leaves, child->num_leaves * sizeof(uint32_t));
+	task->num_leaves += child->num_leaves;
+	task->num_rows += child->num_rows;
+	task->incomplete |= child->incomplete;
+}
+
+void check_subtree(void* arg);
+
+/*
+ * Returns the max key of the subtree, or -1 when it is empty or unreadable
+*/
+int64_t check_node(CheckTreeTask* task, uint32_t page_num, uint32_t parent_page_num, uint32_t depth, int64_t lower_bound, int64_t upper_bound) {
+	CheckContext* context = task->context;
+	uint32_t* errors = &context->errors[page_num];
+
+	if (__atomic_exchange_n(&context->visited[page_num], 1, __ATOMIC_RELAXED)) {
+		// reached twice, the tree has a cycle or a shared child
+		*errors |= CHECK_MALFORMED_NODE;
+		return -1;
+	}
+	void* node = context->pager->pages[page_num];
+	if (node == NULL || (*errors & (CHECK_BAD_CHECKSUM | CHECK_UNREADABLE))) {
+		// placeholder for the leaves we could not see, the chain is not checked across it
+		task->leaves[task->num_leaves++] = INVALID_PAGE_NUM;
+		task->incomplete = true;
+		return -1;
+	}
+
+	bool is_root = page_num == context->root_page_num;
+	if (is_node_root(node) != is_root) {
+		*errors |= CHECK_MALFORMED_NODE;
+	}
+	if (!is_root && *node_parent(node) != parent_page_num) {
+		*errors |= CHECK_PARENT_POINTER;
+	}
+
+	if (get_node_type(node) == NODE_LEAF) {
+		uint32_t num_cells = *leaf_node_num_cells(node);
+		if (num_cells > context->pager->leaf_node_max_cells) {
+			*errors |= CHECK_MALFORMED_NODE;
+			task->incomplete = true;
+			return -1;
+		}
+
+		int64_t previous = lower_bound;
+		for (uint32_t i = 0; i < num_cells; i++) {
+			uint32_t key = *leaf_node_key(node, i);
+			if (key <= previous || key > upper_bound) {
+				*errors |= CHECK_KEY_ORDER;
+			}
+			previous = key;
+		}
+
+		if (task->leaf_depth == CHECK_NO_LEAF_DEPTH) {
+			task->leaf_depth = depth;
+		} else if (task->leaf_depth != depth) {
+			*errors |= CHECK_LEAF_DEPTH;
+		}
+		task->leaves[task->num_leaves++] = page_num;
+		task->num_rows += num_cells;
+
+		return num_cells == 0 ? -1 : (int64_t)*leaf_node_key(node, num_cells - 1);
+	}
+
+	if (get_node_type(node) != NODE_INTERNAL) {
+		*errors |= CHECK_MALFORMED_NODE;
+		task->incomplete = true;
+		return -1;
+	}
+
+	uint32_t num_keys = *internal_node_num_keys(node);
+	if (num_keys > context->pager->internal_node_max_cells || *internal_node_right_child(node) == INVALID_PAGE_NUM) {
+		*errors |= CHECK_MALFORMED_NODE;
+		task->incomplete = true;
+		return -1;
+	}
+
+	// one task per child, the subtrees below the root are checked in parallel
+	CheckTreeTask* children = malloc(sizeof(CheckTreeTask) * (num_keys + 1));
+	int64_t child_lower_bound = lower_bound;
+	for (uint32_t i = 0; i <= num_keys; i++) {
+		bool is_right_child = i == num_keys;
+		uint32_t child_page_num = is_right_child ? *internal_node_right_child(node) : *internal_node_cell(node, i);
+		int64_t key = is_right_child ? upper_bound : *internal_node_key(node, i);
+
+		if (!is_right_child && (key <= child_lower_bound || key > upper_bound)) {
+			*errors |= CHECK_KEY_ORDER;
+		}
+		if (child_page_num >= context->pager->num_pages) {
+			*errors |= CHECK_MALFORMED_NODE;
+			child_page_num = INVALID_PAGE_NUM;
+		}
+
+		children[i] = (CheckTreeTask){
+			.context = context,
+			.page_num = child_page_num,
+			.parent_page_num = page_num,
+			.depth = depth + 1,
+			.lower_bound = child_lower_bound,
+			.upper_bound = key,
+			.max_key = -1,
+			.num_leaves = 0,
+			.leaf_depth = CHECK_NO_LEAF_DEPTH,
+			.num_rows = 0,
+			.incomplete = false,
+		};
+		child_lower_bound = key;
+	}
+
+	if (depth == 0) {
+		run_parallel(children, sizeof(CheckTreeTask), num_keys + 1, check_subtree);
+	} else {
+		for (uint32_t i = 0; i <= num_keys; i++) {
+			check_subtree(&children[i]);
+		}
+	}
+
+	for (uint32_t i = 0; i <= num_keys; i++) {
+		check_tree_merge(task, &children[i]);
+
+		if (i < num_keys && children[i].max_key != -1 && children[i].max_key != *internal_node_key(node, i)) {
+			*errors |= CHECK_SEPARATOR;
+		}
+		if (context->pager->subtree_counts && !children[i].incomplete && *internal_node_child_count(node, i) != children[i].num_rows) {
+			*errors |= CHECK_SUBTREE_COUNT;
+		}
+	}
+
+	int64_t max_key = children[num_keys].max_key;
+	free(children);
+	return max_key;
+}
+
+void check_subtree(void* arg) {
+	CheckTreeTask* task = arg;
+	if (task->page_num == INVALID_PAGE_NUM) {
+		task->leaves[task->num_leaves++] = INVALID_PAGE_NUM;
+		task->incomplete = true;
+		return;
+	}
+	task->max_key = check_node(task, task->page_num, task->parent_page_num, task->depth, task->lower_bound, task->upper_bound);
+}
+
+void check_integrity(Table* table) {
+	Pager* pager = table->pager;
+	CheckContext* context = calloc(1, sizeof(CheckContext));
+	context->pager = pager;
+	context->root_page_num = table->root_page_num;
+
+	uint32_t num_pages = pager->num_pages;
+	uint32_t num_page_tasks = (num_pages + CHECK_PAGES_PER_TASK - 1) / CHECK_PAGES_PER_TASK;
+	CheckPagesTask* page_tasks = malloc(sizeof(CheckPagesTask) * (num_page_tasks + 1));
+	for (uint32_t i = 0; i < num_page_tasks; i++) {
+		uint32_t end_page = (i + 1) * CHECK_PAGES_PER_TASK;
+		page_tasks[i] = (CheckPagesTask){ context, i * CHECK_PAGES_PER_TASK, end_page < num_pages ? end_page : num_pages };
+	}
+	run_parallel(page_tasks, sizeof(CheckPagesTask), num_page_tasks, check_pages);
+	free(page_tasks);
+
+	CheckTreeTask* tree = malloc(sizeof(CheckTreeTask));
+	*tree = (CheckTreeTask){
+		.context = context,
+		.page_num = table->root_page_num,
+		.parent_page_num = INVALID_PAGE_NUM,
+		.depth = 0,
+		.lower_bound = -1,
+		.upper_bound = UINT32_MAX,
+		.max_key = -1,
+		.num_leaves = 0,
+		.leaf_depth = CHECK_NO_LEAF_DEPTH,
+		.num_rows = 0,
+	};
+	check_subtree(tree);
+
+	uint32_t num_leaves = 0;
+	for (uint32_t i = 0; i < tree->num_leaves; i++) {
+		uint32_t leaf = tree->leaves[i];
+		uint32_t expected_next = i + 1 < tree->num_leaves ? tree->leaves[i + 1] : 0;
+		if (leaf == INVALID_PAGE_NUM) {
+			continue;
+		}
+		num_leaves++;
+		if (expected_next != INVALID_PAGE_NUM && *leaf_node_next_leaf(pager->pages[leaf]) != expected_next) {
+			context->errors[leaf] |= CHECK_LEAF_CHAIN;
+		}
+	}
+	for (uint32_t i = 0; i < num_pages; i++) {
+		if (!context->visited[i]) {
+			context->errors[i] |= CHECK_UNREACHABLE;
+		}
+	}
+
+	printf("pages: %d, verified: %d, leaves: %d, rows: %llu\n", num_pages, context->pages_verified, num_leaves, (unsigned long long)tree->num_rows);
+
+	uint32_t num_errors = 0;
+	for (uint32_t i = 0; i < num_pages; i++) {
+		for (uint32_t error = 0; error < CHECK_NUM_ERRORS; error++) {
+			if (context->errors[i] & (1 << error)) {
+				printf("page %d: %s\n", i, CHECK_ERROR_MESSAGES[error]);
+				num_errors++;
+			}
+		}
+	}
+
+	if (num_errors == 0) {
+		printf("ok\n");
+	} else {
+		printf("errors: %d\n", num_errors);
+	}
+
+	free(tree);
+	free(context);
+}
+
+PrepareResult prepare_row(char* id_str, char* username, char* email, Row* row) {
+	if (id_str == NULL || username == NULL || email == NULL) {
+		return PREPARE_SYNTAX_ERROR;
+	}
+
+	if (strlen(username) > COLUMN_USERNAME_SIZE || strlen(email) > COLUMN_EMAIL_SIZE) {
+		return PREPARE_STRING_TOO_LONG;
+	}
+
+	int id = atoi(id_str);
+	if (id < 0) {
+		return PREPARE_NEGATIVE_ID;
+	}
+
+	row->id = id;
+	strcpy(row->username, username);
+	strcpy(row->email, email);
+
+	return PREPARE_SUCCESS;
+}
+
+/*
+ * .import <file> loads "id,username,email" lines.
+ * A reader thread parses and validates them into a ring of rows while the caller
+ * inserts the ones before it, a batch per write_lock hold.
+ * Rejected lines are reported with their line number and the import goes on
+*/
+#define IMPORT_RING_SIZE 1024
+const uint32_t IMPORT_BATCH_SIZE = 256;
+
+typedef struct {
+	Row row;
+	PrepareResult result;
+	uint64_t line;
+} ImportSlot;
+
+typedef struct {
+	FILE* input;
+	ImportSlot ring[IMPORT_RING_SIZE];
+	uint64_t head; // next slot the reader fills
+	uint64_t tail; // next slot the writer drains
+	bool done;
+	bool stopped; // the writer gave up, the reader quits instead of waiting for room
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+} ImportJob;
+
+void* import_reader(void* arg) {
+	ImportJob* job = (ImportJob*)arg;
+	char* line = NULL;
+	size_t capacity = 0;
+	ssize_t length;
+	uint64_t line_num = 0;
+
+	while ((length = getline(&line, &capacity, job->input)) != -1) {
+		line_num++;
+		while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+			line[--length] = 0;
+		}
+		if (length == 0) {
+			continue;
+		}
+
+		// parsed before taking a slot, the lock only covers the hand off
+		ImportSlot slot;
+		slot.line = line_num;
+		// strtok_r, the main thread may be tokenizing a statement at the same time
+		char* save;
+		char* id_str = strtok_r(line, ",", &save);
+		char* username = strtok_r(NULL, ",", &save);
+		char* email = strtok_r(NULL, ",", &save);
+		slot.result = strtok_r(NULL, ",", &save) != NULL ? PREPARE_SYNTAX_ERROR : prepare_row(id_str, username, email, &slot.row);
+
+		pthread_mutex_lock(&job->lock);
+		while (job->head - job->tail == IMPORT_RING_SIZE && !job->stopped) {
+			pthread_cond_wait(&job->not_full, &job->lock);
+		}
+		if (job->stopped) {
+			pthread_mutex_unlock(&job->lock);
+			break;
+		}
+		job->ring[job->head % IMPORT_RING_SIZE] = slot;
+		job->head++;
+		pthread_cond_signal(&job->not_empty);
+		pthread_mutex_unlock(&job->lock);
+	}
+	free(line);
+
+	pthread_mutex_lock(&job->lock);
+	job->done = true;
+	pthread_cond_signal(&job->not_empty);
+	pthread_mutex_unlock(&job->lock);
+	return NULL;
+}
+
+ExecuteResult execute_insert(Statement *st, Table *table);
+
+void import_close(ImportJob* job, pthread_t reader) {
+	pthread_mutex_lock(&job->lock);
+	job->stopped = true;
+	pthread_cond_signal(&job->not_full);
+	pthread_mutex_unlock(&job->lock);
+
+	pthread_join(reader, NULL);
+	fclose(job->input);
+	pthread_mutex_destroy(&job->lock);
+	pthread_cond_destroy(&job->not_empty);
+	pthread_cond_destroy(&job->not_full);
+	free(job);
+}
+
+void import_rows(Table* table, const char* filename) {
+	FILE* input = fopen(filename, "r");
+	if (input == NULL) {
+		printf("unable to open '%s'\n", filename);
+		return;
+	}
+
+	ImportJob* job = malloc(sizeof(ImportJob));
+	job->input = input;
+	job->head = 0;
+	job->tail = 0;
+	job->done = false;
+	job->stopped = false;
+	pthread_mutex_init(&job->lock, NULL);
+	pthread_cond_init(&job->not_empty, NULL);
+	pthread_cond_init(&job->not_full, NULL);
+
+	pthread_t reader;
+	if (pthread_create(&reader, NULL, import_reader, job) != 0) {
+		printf("unable to start import reader\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// a page error stops the reader before it ends the request, see page_error_abort
+	jmp_buf* request_jump = page_error_jump;
+	jmp_buf jump;
+	if (request_jump != NULL) {
+		if (setjmp(jump) != 0) {
+			page_error_jump = request_jump;
+			import_close(job, reader);
+			page_error_abort();
+		}
+		page_error_jump = &jump;
+	}
+
+	uint64_t imported = 0;
+	uint64_t rejected = 0;
+	Statement statement;
+	statement.type = STATEMENT_INSERT;
+
+	while (true) {
+		pthread_mutex_lock(&job->lock);
+		while (job->head == job->tail && !job->done) {
+			pthread_cond_wait(&job->not_empty, &job->lock);
+		}
+		uint64_t tail = job->tail;
+		uint64_t head = job->head;
+		bool done = job->done;
+		pthread_mutex_unlock(&job->lock);
 
-	switch (get_node_type(node)) {
-		case (NODE_LEAF):
-			num_keys = *leaf_node_num_cells(node);
-			indent(indentation_level);
-			printf("- leaf (size %d)\n", num_keys);
-			for (uint32_t i = 0; i < num_keys; i++) {
-				indent(indentation_level + 1);
-				printf("- %d\n", *leaf_node_key(node, i));
-			}
+		if (head == tail && done) {
 			break;
-		case (NODE_INTERNAL):
-			num_keys = *internal_node_num_keys(node);
-			indent(indentation_level);
-			printf("- internal (size %d)\n", num_keys);
-			for (uint32_t i = 0; i < num_keys; i++) {
-				child = *internal_node_child(node, i);
-				print_tree(pager, child, indentation_level + 1);
+		}
+		if (head - tail > IMPORT_BATCH_SIZE) {
+			head = tail + IMPORT_BATCH_SIZE;
+		}
 
-				indent(indentation_level + 1);
-				printf("- key %d\n", *internal_node_key(node, i));
+		// the reader only writes slots past head, these stay put until tail moves
+		pthread_mutex_lock(&table->pager->write_lock);
+		for (uint64_t i = tail; i < head; i++) {
+			ImportSlot* slot = &job->ring[i % IMPORT_RING_SIZE];
+			const char* error = NULL;
+			switch (slot->result) {
+				case (PREPARE_SUCCESS):
+					statement.row_to_insert = slot->row;
+					switch (execute_insert(&statement, table)) {
+						case (EXECUTE_DUPLICATED_KEY):
+							error = "duplicate key";
+							break;
+						case (EXECUTE_TABLE_FULL):
+							error = "table full";
+							break;
+						default:
+							break;
+					}
+					break;
+				case (PREPARE_STRING_TOO_LONG):
+					error = "string is too long";
+					break;
+				case (PREPARE_NEGATIVE_ID):
+					error = "ID must be positive";
+					break;
+				default:
+					error = "syntax error";
+					break;
 			}
-			child = *internal_node_right_child(node);
-			print_tree(pager, child, indentation_level + 1);
-			break;	
+			if (error == NULL) {
+				imported++;
+			} else {
+				printf("line %llu: %s\n", (unsigned long long)slot->line, error);
+				rejected++;
+			}
+		}
+		pthread_mutex_unlock(&table->pager->write_lock);
+		arena_reset(&table->scratch);
+
+		pthread_mutex_lock(&job->lock);
+		job->tail = head;
+		pthread_cond_signal(&job->not_full);
+		pthread_mutex_unlock(&job->lock);
 	}
+
+	page_error_jump = request_jump;
+	import_close(job, reader);
+
+	printf("imported %llu rows, rejected %llu\n", (unsigned long long)imported, (unsigned long long)rejected);
 }
 
 MetaCommandResult do_meta_command(InputBuffer *ib, Table *table) {
@@ -850,11 +3216,31 @@ MetaCommandResult do_meta_command(InputBuffer *ib, Table *table) {
 		exit(EXIT_SUCCESS);
 	} else if (strcmp(ib->buffer, ".constants") == 0) {
 		printf("Constants ->\n");
-		print_constants();
+		print_constants(table->pager);
 		return META_COMMAND_SUCCESS;
 	} else if (strcmp(ib->buffer, ".btree") == 0) {
+		// like statements, so writeback never flushes a page while it is read
 		printf("Btree ->\n");
+		pthread_mutex_lock(&table->pager->write_lock);
 		print_tree(table->pager, 0, 0);
+		pthread_mutex_unlock(&table->pager->write_lock);
+		return META_COMMAND_SUCCESS;
+	} else if (strcmp(ib->buffer, ".check") == 0) {
+		printf("Check ->\n");
+		pthread_mutex_lock(&table->pager->write_lock);
+		check_integrity(table);
+		pthread_mutex_unlock(&table->pager->write_lock);
+		return META_COMMAND_SUCCESS;
+	} else if (strncmp(ib->buffer, ".import ", 8) == 0) {
+		import_rows(table, ib->buffer + 8);
+		return META_COMMAND_SUCCESS;
+	} else if (strcmp(ib->buffer, ".stats") == 0) {
+		pthread_mutex_lock(&table->pager->write_lock);
+		printf("lookups: %llu, last leaf hits: %llu\n", (unsigned long long)table->lookups, (unsigned long long)table->hint_hits);
+		if (table->bloom.bits != NULL) {
+			printf("bloom negatives: %llu\n", (unsigned long long)table->bloom.negatives);
+		}
+		pthread_mutex_unlock(&table->pager->write_lock);
 		return META_COMMAND_SUCCESS;
 	}
 
@@ -869,47 +3255,186 @@ PrepareResult prepare_insert(InputBuffer *ib, Statement *statement) {
 	char *username = strtok(NULL, " ");
 	char *email = strtok(NULL, " ");
 
-	if (id_str == NULL || username == NULL || email == NULL) {
+	return prepare_row(id_str, username, email, &statement->row_to_insert);
+}
+
+PrepareResult prepare_where(Statement *statement) {
+	char *column = strtok(NULL, " ");
+	char *operator = strtok(NULL, " ");
+	char *value = strtok(NULL, " ");
+
+	if (column == NULL || operator == NULL || value == NULL || strcmp(column, "id") != 0 || strtok(NULL, " ") != NULL) {
 		return PREPARE_SYNTAX_ERROR;
 	}
 
-	if (strlen(username) > COLUMN_USERNAME_SIZE || strlen(email) > COLUMN_EMAIL_SIZE) {
-		return PREPARE_STRING_TOO_LONG;
+	// only count(*) can be answered from the ranks
+	for (uint32_t i = 0; i < statement->num_aggregates; i++) {
+		if (statement->aggregates[i] != AGGREGATE_COUNT) {
+			return PREPARE_SYNTAX_ERROR;
+		}
 	}
 
-	int id = atoi(id_str);
-	if (id < 0) {
+	if (strcmp(operator, "<") == 0) {
+		statement->where_operator = COMPARE_LESS;
+	} else if (strcmp(operator, "<=") == 0) {
+		statement->where_operator = COMPARE_LESS_EQUAL;
+	} else if (strcmp(operator, ">") == 0) {
+		statement->where_operator = COMPARE_GREATER;
+	} else if (strcmp(operator, ">=") == 0) {
+		statement->where_operator = COMPARE_GREATER_EQUAL;
+	} else if (strcmp(operator, "=") == 0) {
+		statement->where_operator = COMPARE_EQUAL;
+	} else {
+		return PREPARE_SYNTAX_ERROR;
+	}
+
+	int key = atoi(value);
+	if (key < 0) {
 		return PREPARE_NEGATIVE_ID;
 	}
 
-	statement->row_to_insert.id = id;
-	strcpy(statement->row_to_insert.username, username);
-	strcpy(statement->row_to_insert.email, email);
+	statement->has_where = true;
+	statement->where_key = key;
+	return PREPARE_SUCCESS;
+}
+
+/*
+ * select count(*), min(id), max(id), sum(id), any of them separated by commas,
+ * count(*) alone can take a where id <op> value
+*/
+PrepareResult prepare_aggregate(InputBuffer *ib, Statement *statement) {
+	statement->type = STATEMENT_AGGREGATE;
+	statement->num_aggregates = 0;
+	statement->has_where = false;
+
+	char *select_keyword = strtok(ib->buffer, " ");
+	char *aggregate;
+	while ((aggregate = strtok(NULL, ", ")) != NULL) {
+		if (strcmp(aggregate, "where") == 0 && statement->num_aggregates > 0) {
+			return prepare_where(statement);
+		}
+
+		if (statement->num_aggregates == MAX_AGGREGATES) {
+			return PREPARE_SYNTAX_ERROR;
+		}
+
+		AggregateType* type = &statement->aggregates[statement->num_aggregates++];
+		if (strcmp(aggregate, "count(*)") == 0) {
+			*type = AGGREGATE_COUNT;
+		} else if (strcmp(aggregate, "min(id)") == 0) {
+			*type = AGGREGATE_MIN;
+		} else if (strcmp(aggregate, "max(id)") == 0) {
+			*type = AGGREGATE_MAX;
+		} else if (strcmp(aggregate, "sum(id)") == 0) {
+			*type = AGGREGATE_SUM;
+		} else {
+			return PREPARE_SYNTAX_ERROR;
+		}
+	}
+
+	if (statement->num_aggregates == 0) {
+		return PREPARE_SYNTAX_ERROR;
+	}
+
+	return PREPARE_SUCCESS;
+}
+
+/*
+ * select [unordered] [limit N] [offset M]
+*/
+PrepareResult prepare_select(InputBuffer *ib, Statement *statement) {
+	statement->type = STATEMENT_SELECT;
+	statement->ordered = true;
+	statement->limit = UINT64_MAX;
+	statement->offset = 0;
+
+	char *select_keyword = strtok(ib->buffer, " ");
+	char *word;
+	while ((word = strtok(NULL, " ")) != NULL) {
+		if (strcmp(word, "unordered") == 0) {
+			statement->ordered = false;
+			continue;
+		}
+
+		char *value = strtok(NULL, " ");
+		if (value == NULL) {
+			return PREPARE_SYNTAX_ERROR;
+		}
+
+		char *end;
+		errno = 0;
+		long long number = strtoll(value, &end, 10);
+		if (end == value || *end != 0 || number < 0 || errno == ERANGE) {
+			return PREPARE_SYNTAX_ERROR;
+		}
+
+		if (strcmp(word, "limit") == 0) {
+			statement->limit = number;
+		} else if (strcmp(word, "offset") == 0) {
+			statement->offset = number;
+		} else {
+			return PREPARE_SYNTAX_ERROR;
+		}
+	}
 
 	return PREPARE_SUCCESS;
 }
 
 PrepareResult prepare_statement(InputBuffer *ib, Statement *statement) {
-	if (strcmp(ib->buffer, "select") == 0) {
-		statement->type = STATEMENT_SELECT;
-		return PREPARE_SUCCESS;
+	if (strcmp(ib->buffer, "select") == 0 || strncmp(ib->buffer, "select ", 7) == 0) {
+		if (strchr(ib->buffer, '(') != NULL) {
+			return prepare_aggregate(ib, statement);
+		}
+		return prepare_select(ib, statement);
 	}
 
 	if (strncmp(ib->buffer, "insert", 6) == 0) {
 		return prepare_insert(ib, statement);
 	}
 
+	if (strcmp(ib->buffer, "begin") == 0) {
+		statement->type = STATEMENT_BEGIN;
+		return PREPARE_SUCCESS;
+	}
+
+	if (strcmp(ib->buffer, "commit") == 0) {
+		statement->type = STATEMENT_COMMIT;
+		return PREPARE_SUCCESS;
+	}
+
+	if (strcmp(ib->buffer, "rollback") == 0) {
+		statement->type = STATEMENT_ROLLBACK;
+		return PREPARE_SUCCESS;
+	}
+
 	return PREPARE_UNRECOGNIZED_STATEMENT;
 }
 
+// levels from the root down, every leaf is at the same depth
+uint32_t table_depth(Table* table) {
+	uint32_t depth = 1;
+	void* node = get_page(table->pager, table->root_page_num);
+	while (get_node_type(node) == NODE_INTERNAL) {
+		node = get_page(table->pager, *internal_node_child(node, 0));
+		depth++;
+	}
+	return depth;
+}
+
 ExecuteResult execute_insert(Statement *st, Table *table) {
-  void* node = get_page(table->pager, table->root_page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
+  // a split on every level and a new root, refused up front so no insert stops half way
+  if (table->pager->num_pages + table_depth(table) + 1 > TABLE_MAX_PAGES) {
+    return EXECUTE_TABLE_FULL;
+  }
 
   Row* r = &(st->row_to_insert);
   uint32_t key_to_insert = r->id;
   Cursor* cursor = table_find_by_key(table, key_to_insert);
 
+  // the leaf the key routes to, the root is only that leaf while the tree has one level
+  void* node = get_page(table->pager, cursor->page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+
   if (cursor->cell_num < num_cells) {
     uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
     if (key_at_index == key_to_insert) {
@@ -918,87 +3443,579 @@ ExecuteResult execute_insert(Statement *st, Table *table) {
   }
 
 	leaf_node_insert(cursor, r->id, r);
-
-  free(cursor);
+	if (table->bloom.bits != NULL) {
+		bloom_add(&table->bloom, key_to_insert);
+	}
+	if (table->pager->subtree_counts) {
+		update_subtree_counts(table->pager, table->root_page_num, key_to_insert, true);
+	}
 
   return EXECUTE_SUCCESS;
 }
 
 ExecuteResult execute_select(Statement *st, Table *table) {
+	bool full_scan = st->limit == UINT64_MAX && st->offset == 0;
+	if (full_scan && table_scan_parallel(table, st->ordered)) {
+		return EXECUTE_SUCCESS;
+	}
+
 	Row r;
-	Cursor* cursor = cursor_table_start(table);
+	Cursor* cursor = st->offset == 0 ? cursor_table_start(table) : table_find_by_position(table, st->offset);
 
-	while(!cursor->end_of_table) {
+	for (uint64_t i = 0; i < st->limit && !cursor->end_of_table; i++) {
 		deserialize_row(cursor_value(cursor), &r);
 		print_row(r);
 		advance_cursor(cursor);
 	}
 
-	free(cursor);
+	return EXECUTE_SUCCESS;
+}
+
+/*
+ * Aggregates never deserialize a row.
+ * count and sum walk the leaf chain reading only cell counts and keys,
+ * min and max only descend the leftmost and rightmost paths.
+ * With subtree counts, count and count where id <op> value only descend one path.
+ * count where id = value is a point lookup, the bloom filter can answer it alone.
+*/
+ExecuteResult execute_aggregate(Statement *st, Table *table) {
+	Pager* pager = table->pager;
+	void* root = get_page(pager, table->root_page_num);
+	bool empty = get_node_type(root) == NODE_LEAF && *leaf_node_num_cells(root) == 0;
+
+	bool needs_count = false;
+	bool needs_sum = false;
+	for (uint32_t i = 0; i < st->num_aggregates; i++) {
+		needs_count |= st->aggregates[i] == AGGREGATE_COUNT;
+		needs_sum |= st->aggregates[i] == AGGREGATE_SUM;
+	}
+
+	uint64_t count = 0;
+	uint64_t sum = 0;
+	if (st->has_where) {
+		// count of a key range from the ranks of its ends
+		uint64_t key = st->where_key;
+		switch (st->where_operator) {
+			case (COMPARE_LESS):
+				count = table_rank(table, key);
+				break;
+			case (COMPARE_LESS_EQUAL):
+				count = table_rank(table, key + 1);
+				break;
+			case (COMPARE_GREATER):
+				count = table_row_count(table) - table_rank(table, key + 1);
+				break;
+			case (COMPARE_GREATER_EQUAL):
+				count = table_row_count(table) - table_rank(table, key);
+				break;
+			case (COMPARE_EQUAL):
+				count = table_contains(table, key) ? 1 : 0;
+				break;
+		}
+	} else if (!empty && needs_count && !needs_sum) {
+		count = table_row_count(table);
+	} else if (!empty && needs_sum) {
+		uint32_t page_num = leftmost_leaf(pager, table->root_page_num);
+		do {
+			void* node = get_page(pager, page_num);
+			uint32_t num_cells = *leaf_node_num_cells(node);
+			count += num_cells;
+			for (uint32_t i = 0; needs_sum && i < num_cells; i++) {
+				sum += *leaf_node_key(node, i);
+			}
+			page_num = *leaf_node_next_leaf(node);
+		} while (page_num != 0);
+	}
+
+	printf("(");
+	for (uint32_t i = 0; i < st->num_aggregates; i++) {
+		if (i > 0) {
+			printf(", ");
+		}
+
+		switch (st->aggregates[i]) {
+			case (AGGREGATE_COUNT):
+				printf("%llu", (unsigned long long)count);
+				break;
+			case (AGGREGATE_SUM):
+				printf("%llu", (unsigned long long)sum);
+				break;
+			case (AGGREGATE_MIN):
+				if (empty) {
+					printf("null");
+				} else {
+					printf("%d", *leaf_node_key(get_page(pager, leftmost_leaf(pager, table->root_page_num)), 0));
+				}
+				break;
+			case (AGGREGATE_MAX):
+				if (empty) {
+					printf("null");
+				} else {
+					printf("%d", get_node_max_key(pager, root));
+				}
+				break;
+		}
+	}
+	printf(")\n");
+
+	return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_transaction(Statement *st, Table *table) {
+	Pager* pager = table->pager;
+	if (st->type == STATEMENT_BEGIN) {
+		if (pager->in_transaction) {
+			return EXECUTE_TRANSACTION_ACTIVE;
+		}
+		// the journal holds whole pages at fixed offsets, it cannot restore moved slots or the page map
+		if (pager->compressed) {
+			return EXECUTE_TRANSACTION_UNSUPPORTED;
+		}
+		pager_begin(pager);
+		return EXECUTE_SUCCESS;
+	}
+
+	if (!pager->in_transaction) {
+		return EXECUTE_NO_TRANSACTION;
+	}
 
+	if (st->type == STATEMENT_COMMIT) {
+		pager_commit(pager);
+	} else {
+		pager_rollback(pager);
+		// the restored pages may route keys to other leaves
+		table->last_leaf.valid = false;
+	}
 	return EXECUTE_SUCCESS;
 }
 
 ExecuteResult execute_statement(Statement *st, Table *table) {
 	switch(st->type) {
+		case (STATEMENT_BEGIN):
+		case (STATEMENT_COMMIT):
+		case (STATEMENT_ROLLBACK):
+			return execute_transaction(st, table);
 		case (STATEMENT_SELECT):
 			return execute_select(st, table);
 		case (STATEMENT_INSERT):
 			return execute_insert(st, table);
+		case (STATEMENT_AGGREGATE):
+			return execute_aggregate(st, table);
 	}
 }
 
-int main(int argc, char *argv[]) {
-	if (argc < 2) {
-		printf("must suply a database filename\n"); 
-		exit(EXIT_FAILURE);
+void run_input(InputBuffer* input_buffer, Table* table) {
+	// Non-Sql statements 'meta-commands'
+	if (input_buffer->buffer[0] == '.') {
+		switch (do_meta_command(input_buffer, table)) {
+			case (META_COMMAND_SUCCESS):
+				return;
+			case (META_COMMAND_UNRECOGNIZED_COMMAND):
+				printf("Unrecognized command '%s' \n", input_buffer->buffer);
+				return;
+		}
 	}
 
-	char* filename = argv[1];
-	Table* table = open_db(filename);
+	Statement statement;
+	switch (prepare_statement(input_buffer, &statement)) {
+		case (PREPARE_SUCCESS):
+			break;
+		case (PREPARE_STRING_TOO_LONG):
+			printf("string is too long\n");
+			return;
+		case (PREPARE_NEGATIVE_ID):
+			printf("ID must be positive\n");
+			return;
+		case (PREPARE_SYNTAX_ERROR):
+			printf("Syntax error. Could not parse statement.\n");
+			return;
+		case (PREPARE_UNRECOGNIZED_STATEMENT):
+			printf("Unrecognized keyword at start of '%s'.\n", input_buffer->buffer);
+			return;
+	}
 
-	InputBuffer* input_buffer = new_input_buffer();
-	
-	while(true) {
-		print_prompt();
-		read_input(input_buffer);
+	// writeback copies pages out between statements, never in the middle of one
+	pthread_mutex_lock(&table->pager->write_lock);
+	ExecuteResult result = execute_statement(&statement, table);
+	pthread_mutex_unlock(&table->pager->write_lock);
 
-		// Non-Sql statements 'meta-commands'
-		if (input_buffer->buffer[0] == '.') {
-			switch (do_meta_command(input_buffer, table)) {
-				case (META_COMMAND_SUCCESS):
-					continue;
-				case (META_COMMAND_UNRECOGNIZED_COMMAND):
-					printf("Unrecognized command '%s' \n", input_buffer->buffer);
-					continue;
-			}
+	switch (result) {
+		case (EXECUTE_SUCCESS):
+			printf("executed\n");
+			break;
+		case (EXECUTE_DUPLICATED_KEY):
+			printf("Error: duplicate key\n");
+			break;
+		case (EXECUTE_NO_TRANSACTION):
+			printf("Error: no transaction is active\n");
+			break;
+		case (EXECUTE_TRANSACTION_ACTIVE):
+			printf("Error: a transaction is already active\n");
+			break;
+		case (EXECUTE_TRANSACTION_UNSUPPORTED):
+			printf("Error: transactions are not supported for compressed files\n");
+			break;
+		case (EXECUTE_TABLE_FULL):
+			printf("Error: Table full.\n");
+			break;
+	}
+	arena_reset(&table->scratch);
+}
+
+/*
+ * --serve <socket> shares one open database between local clients over a unix socket.
+ * Both ways a frame is a 4 byte length in host order followed by that many bytes.
+ * A request holds one command as typed at the prompt, its response holds what the
+ * prompt would have printed for it. Clients can send any number of requests before
+ * reading, responses come back in request order. Commands from all connections run
+ * one at a time on the event loop thread, ".exit" only closes the connection and
+ * SIGINT or SIGTERM close the database.
+ * Transactions belong to the pager, so the connection that begins one owns it: other
+ * connections can read but not write until it ends, and it is rolled back if its
+ * connection closes first
+*/
+#ifdef __linux__
+#define SERVER_MAX_EVENTS 64
+const uint32_t SERVER_FRAME_HEADER_SIZE = sizeof(uint32_t);
+const uint32_t SERVER_MAX_REQUEST_SIZE = 64 * 1024;
+const uint32_t SERVER_READ_SIZE = 16 * 1024;
+
+typedef struct Connection {
+	int fd;
+	char* in; // unparsed request bytes
+	size_t in_length;
+	size_t in_capacity;
+	char* out; // responses not sent yet
+	size_t out_length;
+	size_t out_capacity;
+	size_t out_sent;
+	bool closing; // close once out is sent
+	struct Connection* next;
+} Connection;
+
+volatile sig_atomic_t server_stopping = 0;
+Connection* transaction_owner = NULL;
+
+void server_stop(int signal_num) {
+	(void)signal_num;
+	server_stopping = 1;
+}
+
+void buffer_reserve(char** data, size_t* capacity, size_t needed) {
+	if (needed <= *capacity) {
+		return;
+	}
+	size_t new_capacity = *capacity == 0 ? SERVER_READ_SIZE : *capacity;
+	while (new_capacity < needed) {
+		new_capacity *= 2;
+	}
+	*data = realloc(*data, new_capacity);
+	*capacity = new_capacity;
+}
+
+void connection_queue(Connection* conn, const char* response, uint32_t length) {
+	buffer_reserve(&conn->out, &conn->out_capacity, conn->out_length + SERVER_FRAME_HEADER_SIZE + length);
+	memcpy(conn->out + conn->out_length, &length, SERVER_FRAME_HEADER_SIZE);
+	memcpy(conn->out + conn->out_length + SERVER_FRAME_HEADER_SIZE, response, length);
+	conn->out_length += SERVER_FRAME_HEADER_SIZE + length;
+}
+
+bool request_writes(const char* request) {
+	return strncmp(request, "insert", 6) == 0 || strcmp(request, "begin") == 0 || strcmp(request, "commit") == 0
+		|| strcmp(request, "rollback") == 0 || strncmp(request, ".import ", 8) == 0;
+}
+
+void connection_respond(Table* table, Connection* conn, char* request, uint32_t length) {
+	InputBuffer ib;
+	ib.buffer = malloc(length + 1);
+	ib.buffer_length = length + 1;
+	ib.input_length = length;
+	memcpy(ib.buffer, request, length);
+	ib.buffer[length] = 0;
+
+	if (strcmp(ib.buffer, ".exit") == 0) {
+		conn->closing = true;
+		free(ib.buffer);
+		return;
+	}
+	if (transaction_owner != NULL && transaction_owner != conn && request_writes(ib.buffer)) {
+		const char* response = "Error: another connection has a transaction open\n";
+		connection_queue(conn, response, strlen(response));
+		free(ib.buffer);
+		return;
+	}
+
+	// everything the command prints becomes the response
+	char* output = NULL;
+	size_t output_length = 0;
+	FILE* console = stdout;
+	stdout = open_memstream(&output, &output_length);
+	jmp_buf jump;
+	if (setjmp(jump) == 0) {
+		page_error_jump = &jump;
+		pager_begin_request(table->pager);
+		run_input(&ib, table);
+		pager_end_request(table->pager);
+	} else {
+		// the error is already in the response, see page_error_abort
+		pager_undo_request(table->pager);
+		pthread_mutex_unlock(&table->pager->write_lock);
+		table->last_leaf.valid = false;
+		arena_reset(&table->scratch);
+	}
+	page_error_jump = NULL;
+	fclose(stdout);
+	stdout = console;
+	free(ib.buffer);
+
+	if (!table->pager->in_transaction) {
+		transaction_owner = NULL;
+	} else if (transaction_owner == NULL) {
+		transaction_owner = conn;
+	}
+
+	connection_queue(conn, output, output_length);
+	free(output);
+}
+
+// runs every complete request in the input buffer, a partial one waits for more bytes
+void connection_process(Table* table, Connection* conn) {
+	size_t offset = 0;
+	while (!conn->closing && conn->in_length - offset >= SERVER_FRAME_HEADER_SIZE) {
+		uint32_t length;
+		memcpy(&length, conn->in + offset, SERVER_FRAME_HEADER_SIZE);
+		if (length > SERVER_MAX_REQUEST_SIZE) {
+			conn->closing = true;
+			break;
+		}
+		if (conn->in_length - offset - SERVER_FRAME_HEADER_SIZE < length) {
+			break;
 		}
+		connection_respond(table, conn, conn->in + offset + SERVER_FRAME_HEADER_SIZE, length);
+		offset += SERVER_FRAME_HEADER_SIZE + length;
+	}
 
-		Statement statement;
-		switch (prepare_statement(input_buffer, &statement)) {
-			case (PREPARE_SUCCESS):
-				break;
-			case (PREPARE_STRING_TOO_LONG):
-				printf("string is too long\n");
-				continue;
-			case (PREPARE_NEGATIVE_ID):
-				printf("ID must be positive\n");
+	memmove(conn->in, conn->in + offset, conn->in_length - offset);
+	conn->in_length -= offset;
+}
+
+// false once the peer is gone
+bool connection_read(Connection* conn) {
+	while (true) {
+		buffer_reserve(&conn->in, &conn->in_capacity, conn->in_length + SERVER_READ_SIZE);
+		ssize_t n = read(conn->fd, conn->in + conn->in_length, conn->in_capacity - conn->in_length);
+		if (n > 0) {
+			conn->in_length += n;
+		} else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return true;
+		} else if (n == -1 && errno == EINTR) {
+			continue;
+		} else {
+			return false;
+		}
+	}
+}
+
+// false when the socket is broken
+bool connection_write(Connection* conn) {
+	while (conn->out_sent < conn->out_length) {
+		ssize_t n = send(conn->fd, conn->out + conn->out_sent, conn->out_length - conn->out_sent, MSG_NOSIGNAL);
+		if (n >= 0) {
+			conn->out_sent += n;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return true;
+		} else if (errno != EINTR) {
+			return false;
+		}
+	}
+	conn->out_sent = 0;
+	conn->out_length = 0;
+	return true;
+}
+
+void connection_close(Table* table, Connection** connections, Connection* conn) {
+	if (transaction_owner == conn) {
+		Statement statement = { .type = STATEMENT_ROLLBACK };
+		pthread_mutex_lock(&table->pager->write_lock);
+		execute_statement(&statement, table);
+		pthread_mutex_unlock(&table->pager->write_lock);
+		transaction_owner = NULL;
+	}
+
+	for (Connection** link = connections; *link != NULL; link = &(*link)->next) {
+		if (*link == conn) {
+			*link = conn->next;
+			break;
+		}
+	}
+	close(conn->fd);
+	free(conn->in);
+	free(conn->out);
+	free(conn);
+}
+
+void serve(Table* table, const char* path) {
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		printf("socket path is too long\n");
+		exit(EXIT_FAILURE);
+	}
+	strcpy(address.sun_path, path);
+
+	int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	unlink(path);
+	if (listener == -1 || bind(listener, (struct sockaddr*)&address, sizeof(address)) == -1 || listen(listener, SOMAXCONN) == -1) {
+		printf("error: %d::when try to listen on %s\n", errno, path);
+		exit(EXIT_FAILURE);
+	}
+
+	int epoll_fd = epoll_create1(0);
+	struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listener, &event);
+
+	signal(SIGINT, server_stop);
+	signal(SIGTERM, server_stop);
+	printf("listening on %s\n", path);
+	fflush(stdout);
+
+	Connection* connections = NULL;
+	struct epoll_event events[SERVER_MAX_EVENTS];
+	while (!server_stopping) {
+		int num_events = epoll_wait(epoll_fd, events, SERVER_MAX_EVENTS, -1);
+		if (num_events == -1) {
+			if (errno == EINTR) {
 				continue;
-			case (PREPARE_SYNTAX_ERROR):
-				printf("Syntax error. Could not parse statement.\n");
+			}
+			printf("error: %d::when waiting for clients\n", errno);
+			exit(EXIT_FAILURE);
+		}
+
+		for (int i = 0; i < num_events; i++) {
+			if (events[i].data.ptr == NULL) {
+				int fd;
+				while ((fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK)) != -1) {
+					Connection* conn = calloc(1, sizeof(Connection));
+					conn->fd = fd;
+					conn->next = connections;
+					connections = conn;
+					struct epoll_event conn_event = { .events = EPOLLIN, .data.ptr = conn };
+					epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &conn_event);
+				}
 				continue;
-			case (PREPARE_UNRECOGNIZED_STATEMENT):
-				printf("Unrecognized keyword at start of '%s'.\n", input_buffer->buffer);
+			}
+
+			Connection* conn = events[i].data.ptr;
+			bool open = true;
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+				// a peer that shut down its side still gets the responses to what it sent
+				open = connection_read(conn);
+				connection_process(table, conn);
+				conn->closing |= !open;
+			}
+			if (!connection_write(conn) || (conn->closing && conn->out_length == 0)) {
+				connection_close(table, &connections, conn);
 				continue;
+			}
+
+			// only wait for room in the socket while responses are queued
+			struct epoll_event conn_event = { .events = conn->out_length > 0 ? EPOLLOUT : EPOLLIN, .data.ptr = conn };
+			epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &conn_event);
 		}
+	}
 
-		switch (execute_statement(&statement, table)) {
-			case (EXECUTE_SUCCESS):
-				printf("executed\n");
-				break;
-			case (EXECUTE_DUPLICATED_KEY):
-				printf("Error: duplicate key\n");
-				break;
+	while (connections != NULL) {
+		connection_close(table, &connections, connections);
+	}
+	close(epoll_fd);
+	close(listener);
+	unlink(path);
+}
+#else
+void serve(Table* table, const char* path) {
+	printf("server mode needs epoll\n");
+	exit(EXIT_FAILURE);
+}
+#endif
+
+int main(int argc, char *argv[]) {
+	OpenOptions options = { .compress = false, .subtree_counts = false, .page_size = DEFAULT_PAGE_SIZE, .internal_node_max_cells = 0, .direct_io = false, .sync = SYNC_NORMAL,
+		.writeback_ratio = DEFAULT_WRITEBACK_RATIO, .writeback_rate = DEFAULT_WRITEBACK_RATE, .bloom = false };
+	char* filename = NULL;
+	char* serve_path = NULL;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--compress") == 0) {
+			options.compress = true;
+		} else if (strcmp(argv[i], "--counts") == 0) {
+			options.subtree_counts = true;
+		} else if (strcmp(argv[i], "--page-size") == 0 && i + 1 < argc) {
+			options.page_size = atoi(argv[++i]);
+			if (!is_valid_page_size(options.page_size)) {
+				printf("page size must be a power of two between %d and %d\n", MIN_PAGE_SIZE, MAX_PAGE_SIZE);
+				exit(EXIT_FAILURE);
+			}
+		} else if (strcmp(argv[i], "--internal-cells") == 0 && i + 1 < argc) {
+			options.internal_node_max_cells = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+			serve_path = argv[++i];
+		} else if (strcmp(argv[i], "--bloom") == 0) {
+			options.bloom = true;
+		} else if (strcmp(argv[i], "--direct") == 0) {
+			options.direct_io = true;
+		} else if (strcmp(argv[i], "--sync") == 0 && i + 1 < argc) {
+			const char* policy = argv[++i];
+			if (strcmp(policy, "off") == 0) {
+				options.sync = SYNC_OFF;
+			} else if (strcmp(policy, "normal") == 0) {
+				options.sync = SYNC_NORMAL;
+			} else if (strcmp(policy, "full") == 0) {
+				options.sync = SYNC_FULL;
+			} else {
+				printf("unknown sync policy '%s'\n", policy);
+				exit(EXIT_FAILURE);
+			}
+		} else if (strcmp(argv[i], "--writeback-ratio") == 0 && i + 1 < argc) {
+			options.writeback_ratio = atoi(argv[++i]);
+			if (options.writeback_ratio > 100) {
+				printf("writeback ratio must be a percentage\n");
+				exit(EXIT_FAILURE);
+			}
+		} else if (strcmp(argv[i], "--writeback-rate") == 0 && i + 1 < argc) {
+			options.writeback_rate = atoi(argv[++i]);
+			if (options.writeback_rate == 0) {
+				printf("writeback rate must be at least one page per second\n");
+				exit(EXIT_FAILURE);
+			}
+		} else {
+			filename = argv[i];
 		}
 	}
+
+	if (filename == NULL) {
+		printf("must suply a database filename\n"); 
+		exit(EXIT_FAILURE);
+	}
+	if (options.internal_node_max_cells != 0 && (options.internal_node_max_cells < INTERNAL_NODE_MIN_CELLS
+		|| options.internal_node_max_cells > internal_node_cells_for_page(options.page_size))) {
+		printf("internal cells must be between %d and %d\n", INTERNAL_NODE_MIN_CELLS, internal_node_cells_for_page(options.page_size));
+		exit(EXIT_FAILURE);
+	}
+
+	Table* table = open_db(filename, &options);
+
+	if (serve_path != NULL) {
+		serve(table, serve_path);
+		close_db(table);
+		exit(EXIT_SUCCESS);
+	}
+
+	InputBuffer* input_buffer = new_input_buffer();
+	
+	while(true) {
+		print_prompt();
+		read_input(input_buffer);
+		run_input(input_buffer, table);
+	}
 }
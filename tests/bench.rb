@@ -0,0 +1,44 @@
+# Compares page sizes on the same data: inserts, full scans and point lookups.
+# Each phase runs in its own process, the cost of an empty run is subtracted.
+#
+#   make bench
+#   ruby tests/bench.rb [rows] [scans] [lookups]
+
+ROWS = (ARGV[0] || 500).to_i
+SCANS = (ARGV[1] || 200).to_i
+LOOKUPS = (ARGV[2] || 2000).to_i
+PAGE_SIZES = [4096, 8192, 16384, 32768, 65536]
+DB = "./tests/bench.db"
+
+def run(commands, flags = "")
+  start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  IO.popen("./sqlite #{flags} #{DB}", "r+") do |pipe|
+    reader = Thread.new { pipe.read }
+    commands.each { |command| pipe.puts command }
+    pipe.puts ".exit"
+    pipe.close_write
+    reader.join
+  end
+  (Process.clock_gettime(Process::CLOCK_MONOTONIC) - start) * 1000
+end
+
+random = Random.new(1)
+ids = (1..ROWS).to_a.shuffle(random: random)
+inserts = ids.map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+scans = ["select"] * SCANS
+lookups = Array.new(LOOKUPS) { "select count(*) where id = #{random.rand(1..ROWS)}" }
+
+puts "rows: #{ROWS}, scans: #{SCANS}, lookups: #{LOOKUPS}"
+puts "page size   pages   insert ms   scan ms   lookup ms"
+
+PAGE_SIZES.each do |page_size|
+  File.delete(DB) if File.exist?(DB)
+  empty = run([], "--page-size #{page_size}")
+  insert = run(inserts) - empty
+  pages = (File.size(DB) - 4096) / page_size
+  scan = run(scans) - empty
+  lookup = run(lookups) - empty
+  puts format("%9d %7d %11.1f %9.1f %11.1f", page_size, pages, insert, scan, lookup)
+end
+
+File.delete(DB) if File.exist?(DB)
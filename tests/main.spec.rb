@@ -1,15 +1,52 @@
+require 'socket'
+
 describe 'database' do
   before do
-    `rm -rf ./tests/test.db`
+    `rm -rf ./tests/test.db ./tests/test.db-journal ./tests/import.csv ./tests/test.sock`
   end
 
   after(:all) do 
-    `rm -rf ./tests/test.db`
+    `rm -rf ./tests/test.db ./tests/test.db-journal ./tests/import.csv ./tests/test.sock`
+  end
+
+  def crc32c(bytes)
+    crc = 0xFFFFFFFF
+    bytes.each_byte do |byte|
+      crc ^= byte
+      8.times { crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1)) }
+    end
+    crc ^ 0xFFFFFFFF
+  end
+
+  # flips a byte in a page of ./tests/test.db, the pages follow the 4K header
+  def corrupt_page(page_num)
+    offset = (page_num + 1) * 4096 + 100
+    File.open("./tests/test.db", "r+b") do |file|
+      file.seek(offset)
+      byte = file.read(1)
+      file.seek(offset)
+      file.write((byte.ord ^ 0xFF).chr)
+    end
+  end
+
+  # server mode frames: a 4 byte length in host order, then the bytes
+  def frame(command)
+    [command.bytesize].pack("L") + command
+  end
+
+  def read_frame(socket)
+    socket.read(socket.read(4).unpack1("L"))
   end
 
-  def run_script(commands)
+  def start_server
+    server = spawn("./sqlite --serve ./tests/test.sock ./tests/test.db", out: File::NULL)
+    sleep 0.01 until File.exist?("./tests/test.sock")
+    server
+  end
+
+  def run_script(commands, flags = "")
     output = nil
-    IO.popen("./sqlite ./tests/test.db", "r+") do |pipe|
+    IO.popen("./sqlite #{flags} ./tests/test.db", "r+") do |pipe|
       commands.each do |command|
         pipe.puts command
       end
@@ -128,12 +165,31 @@ describe 'database' do
       "COMMON_NODE_HEADER_SIZE: 6",
       "LEAF_NODE_HEADER_SIZE: 14",
       "LEAF_NODE_CELL_SIZE: 297",
-      "LEAF_NODE_SPACE_FOR_CELLS: 4082",
+      "LEAF_NODE_SPACE_FOR_CELLS: 4078",
       "LEAF_NODE_MAX_CELLS: 13",
+      "INTERNAL_NODE_MAX_CELLS: 339",
       "db > ",
     ])
   end
 
+  it 'keeps the page size chosen at creation' do
+    commands = (1..60).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    commands << ".exit"
+    run_script(commands, "--page-size 16384")
+
+    expect(File.size("./tests/test.db")).to eq(4096 + 3 * 16384)
+
+    result = run_script([".constants", ".check", ".exit"])
+    expect(result).to include("LEAF_NODE_SPACE_FOR_CELLS: 16366")
+    expect(result).to include("LEAF_NODE_MAX_CELLS: 55")
+    expect(result).to include("pages: 3, verified: 3, leaves: 2, rows: 60")
+
+    result = run_script([], "--page-size 6000")
+    expect(result).to eq(["page size must be a power of two between 4096 and 65536"])
+  end
+
   it 'print out the structure of a one-node btree' do
     commands = [3, 1, 2].map do |i|
       "insert #{i} user#{i} person#{i}@example.com"
@@ -387,7 +443,7 @@ describe 'database' do
       ".btree",
       ".exit",
     ]
-    result = run_script(script)
+    result = run_script(script, "--internal-cells 3")
     result = result[64...(result.length)]
 
     expect(result).to match_array([
@@ -475,4 +531,649 @@ describe 'database' do
       "db > ",
     ])
   end
+
+  it 'keeps rows in a compressed database file' do
+    commands = (1..15).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    commands << ".exit"
+    run_script(commands, "--compress")
+
+    # 3 plain pages, the zero padding of each row compresses away
+    expect(File.size("./tests/test.db")).to be < 2 * 4096
+
+    result = run_script(["select", ".exit"])
+    expect(result).to match_array([
+      "db > (1, user1, person1@example.com)",
+      *(2..15).map { |i| "(#{i}, user#{i}, person#{i}@example.com)" },
+      "executed",
+      "db > ",
+    ])
+  end
+
+  it 'reuses the slots of compressed pages that moved' do
+    inserts = (1..300).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    run_script(inserts + [".exit"], "--compress")
+    one_session = File.size("./tests/test.db")
+    File.delete("./tests/test.db")
+
+    # every session grows most pages out of their slots
+    inserts.each_slice(5) do |slice|
+      run_script(slice + [".exit"], "--compress")
+    end
+    expect(File.size("./tests/test.db")).to be < one_session + one_session / 10
+
+    result = run_script([".check", ".exit"])
+    expect(result).to include("pages: 43, verified: 43, leaves: 42, rows: 300")
+    expect(result).to include("ok")
+  end
+
+  it 'reads and writes pages with direct io' do
+    result = run_script([], "--direct --compress")
+    expect(result).to eq(["direct io is not supported for compressed files"])
+    File.delete("./tests/test.db")
+
+    commands = (1..40).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    commands << ".exit"
+    run_script(commands, "--direct --sync full")
+
+    result = run_script([".check", "select count(*)", ".exit"], "--direct")
+    expect(result).to eq([
+      "db > Check ->",
+      "pages: 6, verified: 6, leaves: 5, rows: 40",
+      "ok",
+      "db > (40)",
+      "executed",
+      "db > ",
+    ])
+
+  end
+
+  it 'checks the integrity of a multi-level tree' do
+    commands = (1..15).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    commands << ".check"
+    commands << ".exit"
+
+    result = run_script(commands)
+
+    expect(result[15...result.length]).to match_array([
+      "db > Check ->",
+      "pages: 3, verified: 0, leaves: 2, rows: 15",
+      "ok",
+      "db > ",
+    ])
+  end
+
+  it 'detects a corrupted page on disk' do
+    commands = (1..14).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    commands << ".exit"
+    run_script(commands)
+
+    corrupt_page(1)
+
+    result = run_script([".check", ".exit"])
+    expect(result).to match_array([
+      "db > Check ->",
+      "pages: 3, verified: 3, leaves: 1, rows: 7",
+      "page 1: checksum mismatch",
+      "errors: 1",
+      "db > ",
+    ])
+
+    # the leaves are scanned in parallel, the intact one may or may not be printed first
+    result = run_script(["select"])
+    expect(result.last).to end_with("page 1 checksum mismatch. Corrupt file")
+  end
+
+  it 'migrates files from before the header' do
+    # a single leaf with one row, 4096 byte pages from offset 0 and no checksum
+    page = [1, 1, 0, 1, 0, 7].pack("CCLLLL")
+    page += [7].pack("L") + "user7".ljust(33, "\0") + "person7@example.com".ljust(256, "\0")
+    File.binwrite("./tests/test.db", page.ljust(4096, "\0"))
+
+    result = run_script(["select", ".check", ".exit"])
+    expect(result).to match_array([
+      "migrated ./tests/test.db to format version 1",
+      "db > (7, user7, person7@example.com)",
+      "executed",
+      "db > Check ->",
+      "pages: 1, verified: 0, leaves: 1, rows: 1",
+      "ok",
+      "db > ",
+    ])
+    expect(File.size("./tests/test.db")).to eq(2 * 4096)
+  end
+
+  it 'refuses files of another format version' do
+    run_script(["insert 1 user1 person1@example.com", ".exit"])
+
+    File.open("./tests/test.db", "r+b") do |file|
+      header = file.read(4096)
+      header[1216, 4] = [2].pack("L")
+      crc = crc32c(header[0, 4092])
+      header[4092, 4] = [crc].pack("L")
+      file.seek(0)
+      file.write(header)
+    end
+
+    result = run_script([])
+    expect(result).to eq(["unsupported format version 2, this build reads version 1"])
+  end
+
+  it 'reuses page frames across repeated checks' do
+    commands = (1..14).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    commands << ".exit"
+    run_script(commands)
+
+    corrupt_page(1)
+
+    # the corrupted page is read into a fresh frame on every check
+    result = run_script([".check"] * 100 + [".exit"])
+    expect(result.count("errors: 1")).to eq(100)
+  end
+
+  it 'skips the descent for keys in the last leaf' do
+    commands = (1..100).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    commands << ".stats"
+    commands << ".check"
+    commands << ".exit"
+
+    result = run_script(commands)
+
+    # only the first insert and the one after each of the 13 leaf splits descend
+    expect(result[100...result.length]).to eq([
+      "db > lookups: 100, last leaf hits: 86",
+      "db > Check ->",
+      "pages: 15, verified: 0, leaves: 14, rows: 100",
+      "ok",
+      "db > ",
+    ])
+  end
+
+  it 'writes dirty pages back in the background' do
+    # off by default, nothing reaches the file before close
+    IO.popen("./sqlite ./tests/test.db", "r+") do |pipe|
+      (1..60).each do |i|
+        pipe.puts "insert #{i} user#{i} person#{i}@example.com"
+      end
+      pipe.flush
+      sleep 0.2
+      expect(File.size?("./tests/test.db")).to eq(nil)
+
+      pipe.puts ".exit"
+      pipe.close_write
+      pipe.gets(nil)
+    end
+    File.delete("./tests/test.db")
+
+    size_before_exit = nil
+    IO.popen("./sqlite --writeback-ratio 0 ./tests/test.db", "r+") do |pipe|
+      (1..60).each do |i|
+        pipe.puts "insert #{i} user#{i} person#{i}@example.com"
+      end
+      pipe.flush
+
+      # the header and the dirty pages are only written on close, so any page on disk came from writeback
+      deadline = Time.now + 5
+      sleep 0.01 while File.size?("./tests/test.db").to_i < 10 * 4096 && Time.now < deadline
+      size_before_exit = File.size?("./tests/test.db")
+
+      pipe.puts ".exit"
+      pipe.close_write
+      pipe.gets(nil)
+    end
+
+    expect(size_before_exit).to eq(10 * 4096)
+
+    result = run_script([".check", ".exit"])
+    expect(result).to eq([
+      "db > Check ->",
+      "pages: 9, verified: 9, leaves: 8, rows: 60",
+      "ok",
+      "db > ",
+    ])
+  end
+
+  it 'imports rows from a csv file' do
+    lines = (1..300).to_a.shuffle(random: Random.new(7)).map do |i|
+      "#{i},user#{i},person#{i}@example.com"
+    end
+    lines.insert(50, "12,again,again@example.com")
+    lines.insert(100, "-4,negative,negative@example.com")
+    lines.insert(150, "8,#{"a" * 33},long@example.com")
+    lines.insert(200, "not a row")
+    lines.insert(250, "")
+    File.write("./tests/import.csv", lines.join("\n") + "\n")
+
+    result = run_script([
+      ".import ./tests/import.csv",
+      "select count(*)",
+      ".check",
+      ".exit",
+    ])
+
+    # whichever of the two rows for 12 comes second is the one rejected
+    duplicate_line = lines.each_index.select { |i| lines[i].start_with?("12,") }.last + 1
+    expect(result).to eq([
+      "db > line #{duplicate_line}: duplicate key",
+      "line 101: ID must be positive",
+      "line 151: string is too long",
+      "line 201: syntax error",
+      "imported 300 rows, rejected 4",
+      "db > (300)",
+      "executed",
+      "db > Check ->",
+      "pages: 33, verified: 0, leaves: 32, rows: 300",
+      "ok",
+      "db > ",
+    ])
+  end
+
+  it 'answers lookups of absent keys from the bloom filter' do
+    commands = (1..100).map do |i|
+      "insert #{i * 2} user#{i} person#{i}@example.com"
+    end
+    commands << ".exit"
+    run_script(commands)
+
+    # the filter is rebuilt from the leaves on open
+    commands = (1..100).map do |i|
+      "select count(*) where id = #{i * 2 - 1}"
+    end
+    commands << "select count(*) where id = 100"
+    commands << "insert 100 again again@example.com"
+    # inserts descend anyway, they only add to the filter
+    commands << "insert 201 user201 person201@example.com"
+    commands << ".stats"
+    commands << ".exit"
+    result = run_script(commands, "--bloom")
+
+    expect(result.count("db > (0)")).to eq(100)
+    expect(result[200...result.length]).to eq([
+      "db > (1)",
+      "executed",
+      "db > Error: duplicate key",
+      "db > executed",
+      "db > lookups: 3, last leaf hits: 1",
+      "bloom negatives: 100",
+      "db > ",
+    ])
+  end
+
+  it 'serves pipelined requests from many clients over a socket' do
+    server = start_server
+
+    # every client sends all its inserts before reading a single response
+    clients = (0...8).map { UNIXSocket.new("./tests/test.sock") }
+    clients.each_with_index do |client, c|
+      client.write((1..20).map { |i| frame("insert #{c * 20 + i} user#{i} person#{i}@example.com") }.join)
+    end
+    responses = clients.flat_map { |client| (1..20).map { read_frame(client) } }
+    expect(responses.uniq).to eq(["executed\n"])
+
+    client = clients.first
+    client.write(frame("select count(*)") + frame("insert 5 again again@example.com") + frame(".exit"))
+    expect(read_frame(client)).to eq("(160)\nexecuted\n")
+    expect(read_frame(client)).to eq("Error: duplicate key\n")
+    expect(client.read).to eq("")
+
+    Process.kill("TERM", server)
+    Process.wait(server)
+    expect(File.exist?("./tests/test.sock")).to eq(false)
+
+    result = run_script([".check", ".exit"])
+    expect(result).to eq([
+      "db > Check ->",
+      "pages: 23, verified: 23, leaves: 22, rows: 160",
+      "ok",
+      "db > ",
+    ])
+  end
+
+  it 'ties a transaction to the connection that began it' do
+    server = start_server
+
+    owner = UNIXSocket.new("./tests/test.sock")
+    other = UNIXSocket.new("./tests/test.sock")
+    owner.write(frame("begin") + frame("insert 1 user1 person1@example.com"))
+    expect([read_frame(owner), read_frame(owner)]).to eq(["executed\n", "executed\n"])
+
+    other.write(frame("begin") + frame("insert 2 user2 person2@example.com") + frame("select count(*)"))
+    expect(read_frame(other)).to eq("Error: another connection has a transaction open\n")
+    expect(read_frame(other)).to eq("Error: another connection has a transaction open\n")
+    expect(read_frame(other)).to eq("(1)\nexecuted\n")
+
+    # the server notices the hang up on its own time
+    owner.close
+    count = nil
+    deadline = Time.now + 5
+    while count != "(0)\nexecuted\n" && Time.now < deadline
+      other.write(frame("select count(*)"))
+      count = read_frame(other)
+    end
+    expect(count).to eq("(0)\nexecuted\n")
+
+    other.write(frame("begin") + frame("insert 2 user2 person2@example.com") + frame("commit"))
+    expect((1..3).map { read_frame(other) }).to eq(["executed\n"] * 3)
+    other.close
+
+    Process.kill("TERM", server)
+    Process.wait(server)
+
+    result = run_script(["select", ".exit"])
+    expect(result).to eq([
+      "db > (2, user2, person2@example.com)",
+      "executed",
+      "db > ",
+    ])
+  end
+
+  it 'answers page errors per request and keeps serving' do
+    commands = (1..14).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    commands << ".exit"
+    run_script(commands)
+
+    corrupt_page(1)
+
+    server = start_server
+
+    client = UNIXSocket.new("./tests/test.sock")
+    client.write(frame("select") + frame("insert 20 user20 person20@example.com") + frame("select count(*) where id = 3"))
+    expect(read_frame(client)).to eq("page 1 checksum mismatch. Corrupt file\n")
+    expect(read_frame(client)).to eq("page 1 checksum mismatch. Corrupt file\n")
+    expect(read_frame(client)).to eq("(1)\nexecuted\n")
+    client.close
+
+    Process.kill("TERM", server)
+    Process.wait(server)
+    expect($?.success?).to eq(true)
+  end
+
+  it 'undoes an insert stopped by a page error in a split' do
+    commands = (1..14).map do |i|
+      "insert #{i * 2} user#{i} person#{i}@example.com"
+    end
+    commands << ".exit"
+    run_script(commands)
+
+    corrupt_page(1)
+
+    server = start_server
+
+    # the seventh insert splits the left leaf and reads the corrupt right one
+    client = UNIXSocket.new("./tests/test.sock")
+    [1, 3, 5, 7, 9, 11].each do |i|
+      client.write(frame("insert #{i} user#{i} person#{i}@example.com"))
+      expect(read_frame(client)).to eq("executed\n")
+    end
+    client.write(frame("insert 13 user13 person13@example.com"))
+    expect(read_frame(client)).to eq("page 1 checksum mismatch. Corrupt file\n")
+    client.close
+
+    Process.kill("TERM", server)
+    Process.wait(server)
+
+    result = run_script([".check", ".exit"])
+    expect(result).to match_array([
+      "db > Check ->",
+      "pages: 3, verified: 3, leaves: 1, rows: 13",
+      "page 1: checksum mismatch",
+      "errors: 1",
+      "db > ",
+    ])
+  end
+
+  it 'refuses inserts once the file is full' do
+    commands = (1..800).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    commands << "select count(*)"
+    commands << ".exit"
+    result = run_script(commands)
+
+    expect(result.count("db > Error: Table full.")).to eq(121)
+    expect(result.last(3)).to eq(["db > (679)", "executed", "db > "])
+  end
+
+  it 'agrees with a reference set under a randomized workload' do
+    ["--internal-cells 3", "--counts --bloom --internal-cells 3", "--compress --page-size 8192", "--direct --counts"].each do |flags|
+      output = `./stress --ops 20000 --check-every 500 --reopen-every 2000 #{flags}`
+      expect($?.success?).to eq(true)
+      expect(output.lines.last).to match(/\Aok: 20000 ops/)
+    end
+  end
+
+  it 'prints rows in key order from a parallel scan' do
+    ids = (1..100).to_a.shuffle(random: Random.new(42))
+    commands = ids.map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    commands << "select"
+    commands << ".exit"
+
+    result = run_script(commands)
+
+    expect(result[100...result.length]).to eq([
+      "db > (1, user1, person1@example.com)",
+      *(2..100).map { |i| "(#{i}, user#{i}, person#{i}@example.com)" },
+      "executed",
+      "db > ",
+    ])
+  end
+
+  it 'prints every row from an unordered scan' do
+    commands = (1..100).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    commands << "select unordered"
+    commands << ".exit"
+
+    result = run_script(commands)
+    rows = result[100...-2].map { |line| line.delete_prefix("db > ") }
+
+    expect(rows).to match_array((1..100).map { |i| "(#{i}, user#{i}, person#{i}@example.com)" })
+  end
+
+  it 'answers aggregates without reading the rows' do
+    commands = (1..30).to_a.shuffle(random: Random.new(7)).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    commands << "select count(*), min(id), max(id), sum(id)"
+    commands << "select count(*)"
+    commands << "select avg(id)"
+    commands << ".exit"
+
+    result = run_script(commands)
+
+    expect(result[30...result.length]).to match_array([
+      "db > (30, 1, 30, 465)",
+      "executed",
+      "db > (30)",
+      "executed",
+      "db > Syntax error. Could not parse statement.",
+      "db > ",
+    ])
+  end
+
+  it 'answers aggregates on an empty table' do
+    result = run_script([
+      "select count(*), min(id), max(id)",
+      ".exit",
+    ])
+    expect(result).to match_array([
+      "db > (0, null, null)",
+      "executed",
+      "db > ",
+    ])
+  end
+
+  it 'pages through rows with limit and offset' do
+    commands = (1..40).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    commands << "select limit 2 offset 20"
+    commands << "select offset 39"
+    commands << "select limit -1"
+    commands << "select limit abc"
+    commands << "select offset 1x"
+    commands << ".exit"
+
+    result = run_script(commands)
+
+    expect(result[40...result.length]).to eq([
+      "db > (21, user21, person21@example.com)",
+      "(22, user22, person22@example.com)",
+      "executed",
+      "db > (40, user40, person40@example.com)",
+      "executed",
+      "db > Syntax error. Could not parse statement.",
+      "db > Syntax error. Could not parse statement.",
+      "db > Syntax error. Could not parse statement.",
+      "db > ",
+    ])
+  end
+
+  it 'keeps subtree counts for positional and ranged queries' do
+    commands = (1..60).to_a.shuffle(random: Random.new(3)).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    commands << "select limit 2 offset 40"
+    commands << "select count(*) where id < 25"
+    commands << "select count(*) where id >= 25"
+    commands << "select min(id) where id > 3"
+    commands << ".check"
+    commands << ".exit"
+
+    result = run_script(commands, "--counts --internal-cells 3")
+
+    expect(result[60...result.length]).to eq([
+      "db > (41, user41, person41@example.com)",
+      "(42, user42, person42@example.com)",
+      "executed",
+      "db > (24)",
+      "executed",
+      "db > (36)",
+      "executed",
+      "db > Syntax error. Could not parse statement.",
+      "db > Check ->",
+      "pages: 10, verified: 0, leaves: 7, rows: 60",
+      "ok",
+      "db > ",
+    ])
+
+    # the counts are a property of the file, not of the flag
+    result = run_script([
+      "insert 61 user61 person61@example.com",
+      "select count(*) where id > 59",
+      "select limit 1 offset 60",
+      ".exit",
+    ])
+
+    expect(result).to eq([
+      "db > executed",
+      "db > (2)",
+      "executed",
+      "db > (61, user61, person61@example.com)",
+      "executed",
+      "db > ",
+    ])
+  end
+
+  it 'commits and rolls back transactions' do
+    result = run_script([
+      "commit",
+      "begin",
+      "begin",
+      "insert 1 user1 person1@example.com",
+      "insert 2 user2 person2@example.com",
+      "rollback",
+      "select",
+      "begin",
+      "insert 3 user3 person3@example.com",
+      "commit",
+      "begin",
+      "insert 4 user4 person4@example.com",
+      ".exit",
+    ])
+    expect(result).to eq([
+      "db > Error: no transaction is active",
+      "db > executed",
+      "db > Error: a transaction is already active",
+      "db > executed",
+      "db > executed",
+      "db > executed",
+      "db > executed",
+      "db > executed",
+      "db > executed",
+      "db > executed",
+      "db > executed",
+      "db > executed",
+      "db > ",
+    ])
+
+    # the transaction left open at exit is discarded
+    result = run_script(["select", ".exit"])
+    expect(result).to eq([
+      "db > (3, user3, person3@example.com)",
+      "executed",
+      "db > ",
+    ])
+
+    # the journal cannot restore compressed pages that moved
+    File.delete("./tests/test.db")
+    result = run_script(["begin", "insert 1 user1 person1@example.com", ".exit"], "--compress")
+    expect(result).to eq([
+      "db > Error: transactions are not supported for compressed files",
+      "db > executed",
+      "db > ",
+    ])
+  end
+
+  it 'rolls back a commit that was cut short using the journal' do
+    commands = (1..20).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    commands << ".exit"
+    run_script(commands)
+    before = File.binread("./tests/test.db")
+
+    commands = ["begin"] + (21..40).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    commands << "commit"
+    commands << ".exit"
+    run_script(commands)
+    after = File.binread("./tests/test.db")
+
+    # what a commit leaves behind when it stops after writing the pages
+    page_size = 4096
+    num_pages = (before.size - 4096) / page_size
+    entries = (0...num_pages).select do |i|
+      before[4096 + i * page_size, page_size] != after[4096 + i * page_size, page_size]
+    end
+    header = "SQLJ" + [page_size, num_pages, entries.size].pack("V3")
+    journal = header + [crc32c(header)].pack("V")
+    entries.each { |i| journal += [i].pack("V") + before[4096 + i * page_size, page_size] }
+    File.binwrite("./tests/test.db-journal", journal)
+
+    result = run_script(["select count(*), max(id)", ".check", ".exit"])
+    expect(result).to include("db > (20, 20)")
+    expect(result).to include("ok")
+    expect(File.exist?("./tests/test.db-journal")).to eq(false)
+    expect(File.binread("./tests/test.db")[4096..]).to eq(before[4096..])
+  end
 end
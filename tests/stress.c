@@ -0,0 +1,353 @@
+/*
+ * Randomized workload against a reference set of keys.
+ * Inserts (new and duplicate keys), point lookups, ranks, positions and transactions
+ * run straight against the engine, every result is compared with the reference.
+ * Every --check-every operations the tree is verified with .check and a full scan,
+ * every --reopen-every operations the file is closed and opened again.
+ * A file holds at most TABLE_MAX_PAGES pages, so when one is about full it is
+ * verified and a new round starts on an empty file.
+ *
+ *   make stress
+ *   ./stress [--ops N] [--seed S] [--check-every N] [--reopen-every N] [--compress] [--counts] [--bloom] [--direct] [--page-size N] [--internal-cells N]
+*/
+#define main sqlite_main
+#include "../sqlite.c"
+#undef main
+
+#define STRESS_KEY_SPACE 4096
+const char* STRESS_DB = "./tests/stress.db";
+const uint32_t STRESS_PAGE_HEADROOM = 8; // pages one insert can add, a split per level and a new root
+
+typedef struct {
+	uint64_t seed;
+	uint64_t state;
+	uint64_t op;
+	Table* table;
+	OpenOptions options;
+	bool present[STRESS_KEY_SPACE];
+	uint32_t num_present;
+	// reference as of begin, restored on rollback
+	bool saved_present[STRESS_KEY_SPACE];
+	uint32_t saved_num_present;
+} Stress;
+
+uint64_t stress_random(Stress* stress) {
+	// xorshift64*
+	stress->state ^= stress->state >> 12;
+	stress->state ^= stress->state << 25;
+	stress->state ^= stress->state >> 27;
+	return stress->state * 0x2545f4914f6cdd1dULL;
+}
+
+void stress_fail(Stress* stress, const char* message, uint32_t key) {
+	printf("seed %llu, op %llu, key %d: %s\n", (unsigned long long)stress->seed, (unsigned long long)stress->op, key, message);
+	exit(EXIT_FAILURE);
+}
+
+double stress_now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void stress_row(uint32_t key, Row* row) {
+	row->id = key;
+	sprintf(row->username, "user%d", key);
+	sprintf(row->email, "person%d@example.com", key);
+}
+
+ExecuteResult stress_execute(Stress* stress, Statement* statement) {
+	Table* table = stress->table;
+	pthread_mutex_lock(&table->pager->write_lock);
+	ExecuteResult result = execute_statement(statement, table);
+	pthread_mutex_unlock(&table->pager->write_lock);
+	return result;
+}
+
+// reads go straight to the tree, under write_lock like the statements
+bool stress_contains(Stress* stress, uint32_t key) {
+	Table* table = stress->table;
+	pthread_mutex_lock(&table->pager->write_lock);
+	bool contains = table_contains(table, key);
+	pthread_mutex_unlock(&table->pager->write_lock);
+	return contains;
+}
+
+uint64_t stress_rank(Stress* stress, uint32_t key) {
+	Table* table = stress->table;
+	pthread_mutex_lock(&table->pager->write_lock);
+	uint64_t rank = table_rank(table, key);
+	pthread_mutex_unlock(&table->pager->write_lock);
+	return rank;
+}
+
+uint32_t stress_key_at(Stress* stress, uint64_t position) {
+	Table* table = stress->table;
+	pthread_mutex_lock(&table->pager->write_lock);
+	Cursor* cursor = table_find_by_position(table, position);
+	uint32_t key = *leaf_node_key(get_page(table->pager, cursor->page_num), cursor->cell_num);
+	pthread_mutex_unlock(&table->pager->write_lock);
+	return key;
+}
+
+void stress_insert(Stress* stress, uint32_t key) {
+	Statement statement = { .type = STATEMENT_INSERT };
+	stress_row(key, &statement.row_to_insert);
+	ExecuteResult result = stress_execute(stress, &statement);
+
+	if (stress->present[key] && result != EXECUTE_DUPLICATED_KEY) {
+		stress_fail(stress, "duplicate key was inserted", key);
+	}
+	if (!stress->present[key] && result != EXECUTE_SUCCESS) {
+		stress_fail(stress, "new key was rejected", key);
+	}
+	if (!stress->present[key]) {
+		stress->present[key] = true;
+		stress->num_present++;
+	}
+}
+
+uint32_t stress_existing_key(Stress* stress) {
+	uint32_t key = stress_random(stress) % STRESS_KEY_SPACE;
+	while (!stress->present[key]) {
+		key = (key + 1) % STRESS_KEY_SPACE;
+	}
+	return key;
+}
+
+void stress_transaction(Stress* stress) {
+	Pager* pager = stress->table->pager;
+	Statement statement;
+	if (pager->compressed) {
+		statement.type = STATEMENT_BEGIN;
+		if (stress_execute(stress, &statement) != EXECUTE_TRANSACTION_UNSUPPORTED) {
+			stress_fail(stress, "compressed file began a transaction", 0);
+		}
+		return;
+	}
+
+	if (!pager->in_transaction) {
+		statement.type = STATEMENT_BEGIN;
+		memcpy(stress->saved_present, stress->present, sizeof(stress->present));
+		stress->saved_num_present = stress->num_present;
+	} else if (stress_random(stress) % 2 == 0) {
+		statement.type = STATEMENT_COMMIT;
+	} else {
+		statement.type = STATEMENT_ROLLBACK;
+		memcpy(stress->present, stress->saved_present, sizeof(stress->present));
+		stress->num_present = stress->saved_num_present;
+	}
+
+	if (stress_execute(stress, &statement) != EXECUTE_SUCCESS) {
+		stress_fail(stress, "transaction statement failed", 0);
+	}
+}
+
+void stress_end_transaction(Stress* stress) {
+	if (stress->table->pager->in_transaction) {
+		Statement statement = { .type = STATEMENT_COMMIT };
+		stress_execute(stress, &statement);
+	}
+}
+
+/*
+ * .check covers page checksums, parent pointers, key order, separators, the leaf
+ * chain and subtree counts, the scan covers the rows themselves
+*/
+void stress_verify(Stress* stress) {
+	Table* table = stress->table;
+
+	char* output = NULL;
+	size_t output_length = 0;
+	FILE* console = stdout;
+	stdout = open_memstream(&output, &output_length);
+	pthread_mutex_lock(&table->pager->write_lock);
+	check_integrity(table);
+	pthread_mutex_unlock(&table->pager->write_lock);
+	fclose(stdout);
+	stdout = console;
+	if (output_length < 3 || strcmp(output + output_length - 3, "ok\n") != 0) {
+		printf("%s", output);
+		stress_fail(stress, "check failed", 0);
+	}
+	free(output);
+
+	pthread_mutex_lock(&table->pager->write_lock);
+	Cursor* cursor = cursor_table_start(table);
+	uint32_t expected = 0;
+	for (uint32_t i = 0; i < stress->num_present; i++) {
+		while (!stress->present[expected]) {
+			expected++;
+		}
+		if (cursor->end_of_table) {
+			stress_fail(stress, "scan ended early", expected);
+		}
+
+		Row row;
+		Row expected_row;
+		deserialize_row(cursor_value(cursor), &row);
+		stress_row(expected, &expected_row);
+		if (row.id != expected || strcmp(row.username, expected_row.username) != 0 || strcmp(row.email, expected_row.email) != 0) {
+			stress_fail(stress, "scan returned the wrong row", expected);
+		}
+		advance_cursor(cursor);
+		expected++;
+	}
+	if (!cursor->end_of_table) {
+		stress_fail(stress, "scan returned extra rows", 0);
+	}
+	if (table_row_count(table) != stress->num_present) {
+		stress_fail(stress, "row count is wrong", 0);
+	}
+	pthread_mutex_unlock(&table->pager->write_lock);
+	arena_reset(&table->scratch);
+}
+
+void stress_close(Stress* stress) {
+	close_db(stress->table);
+	free(stress->table);
+	stress->table = NULL;
+}
+
+void stress_new_round(Stress* stress) {
+	if (stress->table != NULL) {
+		stress_close(stress);
+	}
+	unlink(STRESS_DB);
+	memset(stress->present, 0, sizeof(stress->present));
+	stress->num_present = 0;
+	stress->table = open_db(STRESS_DB, &stress->options);
+}
+
+void stress_step(Stress* stress) {
+	Table* table = stress->table;
+	uint32_t key = stress_random(stress) % STRESS_KEY_SPACE;
+	uint32_t choice = stress_random(stress) % 100;
+
+	if (choice < 55) {
+		stress_insert(stress, key);
+	} else if (choice < 65 && stress->num_present > 0) {
+		stress_insert(stress, stress_existing_key(stress));
+	} else if (choice < 85) {
+		if (stress_contains(stress, key) != stress->present[key]) {
+			stress_fail(stress, "lookup disagrees with the reference", key);
+		}
+	} else if (choice < 92) {
+		uint64_t rank = 0;
+		for (uint32_t i = 0; i < key; i++) {
+			rank += stress->present[i];
+		}
+		if (stress_rank(stress, key) != rank) {
+			stress_fail(stress, "rank disagrees with the reference", key);
+		}
+	} else if (choice < 97 && stress->num_present > 0) {
+		uint64_t position = stress_random(stress) % stress->num_present;
+		uint32_t expected = 0;
+		for (uint64_t seen = 0; !stress->present[expected] || seen < position; expected++) {
+			seen += stress->present[expected];
+		}
+		if (stress_key_at(stress, position) != expected) {
+			stress_fail(stress, "position disagrees with the reference", expected);
+		}
+	} else {
+		stress_transaction(stress);
+	}
+	arena_reset(&table->scratch);
+}
+
+int main(int argc, char* argv[]) {
+	Stress* stress = calloc(1, sizeof(Stress));
+	stress->options = (OpenOptions){ .compress = false, .subtree_counts = false, .page_size = DEFAULT_PAGE_SIZE, .internal_node_max_cells = 0, .direct_io = false, .sync = SYNC_OFF,
+		.writeback_ratio = DEFAULT_WRITEBACK_RATIO, .writeback_rate = DEFAULT_WRITEBACK_RATE, .bloom = false };
+	uint64_t num_ops = 1000000;
+	uint64_t check_every = 1000;
+	uint64_t reopen_every = 5000;
+	stress->seed = 1;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc) {
+			num_ops = strtoull(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+			stress->seed = strtoull(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "--check-every") == 0 && i + 1 < argc) {
+			check_every = strtoull(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "--reopen-every") == 0 && i + 1 < argc) {
+			reopen_every = strtoull(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "--compress") == 0) {
+			stress->options.compress = true;
+		} else if (strcmp(argv[i], "--counts") == 0) {
+			stress->options.subtree_counts = true;
+		} else if (strcmp(argv[i], "--bloom") == 0) {
+			stress->options.bloom = true;
+		} else if (strcmp(argv[i], "--direct") == 0) {
+			stress->options.direct_io = true;
+		} else if (strcmp(argv[i], "--page-size") == 0 && i + 1 < argc) {
+			stress->options.page_size = atoi(argv[++i]);
+			if (!is_valid_page_size(stress->options.page_size)) {
+				printf("page size must be a power of two between %d and %d\n", MIN_PAGE_SIZE, MAX_PAGE_SIZE);
+				exit(EXIT_FAILURE);
+			}
+		} else if (strcmp(argv[i], "--internal-cells") == 0 && i + 1 < argc) {
+			stress->options.internal_node_max_cells = atoi(argv[++i]);
+		} else {
+			printf("unknown argument '%s'\n", argv[i]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (stress->options.internal_node_max_cells != 0 && (stress->options.internal_node_max_cells < INTERNAL_NODE_MIN_CELLS
+		|| stress->options.internal_node_max_cells > internal_node_cells_for_page(stress->options.page_size))) {
+		printf("internal cells must be between %d and %d\n", INTERNAL_NODE_MIN_CELLS, internal_node_cells_for_page(stress->options.page_size));
+		exit(EXIT_FAILURE);
+	}
+	if (check_every == 0 || reopen_every == 0) {
+		printf("check and reopen intervals must be positive\n");
+		exit(EXIT_FAILURE);
+	}
+	stress->state = stress->seed * 0x9e3779b97f4a7c15ULL + 1;
+
+	uint64_t rounds = 1;
+	uint64_t reopens = 0;
+	double start = stress_now();
+	double last_report = start;
+	stress_new_round(stress);
+
+	for (stress->op = 1; stress->op <= num_ops; stress->op++) {
+		stress_step(stress);
+
+		if (stress->op % check_every == 0) {
+			stress_verify(stress);
+		}
+		if (stress->op % reopen_every == 0) {
+			stress_end_transaction(stress);
+			stress_close(stress);
+			stress->table = open_db(STRESS_DB, &stress->options);
+			stress_verify(stress);
+			reopens++;
+		}
+		if (stress->table->pager->num_pages + STRESS_PAGE_HEADROOM >= TABLE_MAX_PAGES) {
+			stress_end_transaction(stress);
+			stress_verify(stress);
+			stress_new_round(stress);
+			rounds++;
+		}
+
+		double now = stress_now();
+		if (now - last_report >= 1) {
+			printf("ops: %llu, rounds: %llu, reopens: %llu, ops/s: %.0f\n", (unsigned long long)stress->op,
+				(unsigned long long)rounds, (unsigned long long)reopens, stress->op / (now - start));
+			fflush(stdout);
+			last_report = now;
+		}
+	}
+
+	stress_end_transaction(stress);
+	stress_verify(stress);
+	stress_close(stress);
+	unlink(STRESS_DB);
+
+	double elapsed = stress_now() - start;
+	printf("ok: %llu ops, %llu rounds, %llu reopens in %.1fs, ops/s: %.0f\n", (unsigned long long)num_ops,
+		(unsigned long long)rounds, (unsigned long long)reopens, elapsed, num_ops / elapsed);
+	free(stress);
+	return 0;
+}